@@ -0,0 +1,104 @@
+#pragma once
+
+#include <fmt/core.h>
+#include <gst/gst.h>
+#include <sys/resource.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+// Helpers shared by the benchmarks. Every benchmark encodes the same
+// synthetic clip so their numbers can be compared with each other.
+
+#define FRAME_RATE 30
+
+struct PassResult {
+    double wall_seconds = 0.0;
+    double cpu_seconds = 0.0;
+    guint64 encoded_bytes = 0;
+};
+
+static inline double cpu_time_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static inline GstPadProbeReturn cb_count_bytes(GstPad *pad,
+                                               GstPadProbeInfo *info,
+                                               gpointer user_data) {
+    guint64 *encoded_bytes = (guint64 *)user_data;
+    *encoded_bytes += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+    return GST_PAD_PROBE_OK;
+}
+
+static inline std::string source_description(uint width, uint height,
+                                             uint frames,
+                                             const char *format = "I420") {
+    // A scrolling test pattern keeps both detail and motion in every frame
+    return fmt::format(
+        "videotestsrc num-buffers={} pattern=smpte horizontal-speed=4 "
+        "! video/x-raw,format={},width={},height={},framerate={}/1",
+        frames, format, width, height, FRAME_RATE);
+}
+
+/**
+ * @brief Runs a pipeline to EOS while measuring wall and CPU time.
+ *
+ * If the pipeline contains an element named "encoder", the bytes leaving it
+ * are counted as well.
+ *
+ * @param description The gst-launch description of the pipeline.
+ * @param result Where to store the measurements.
+ * @param setup Called with the pipeline before it is started, may be empty.
+ * @return True if the pipeline reached EOS without errors.
+ */
+static inline bool run_pass(
+    const std::string &description, PassResult &result,
+    const std::function<void(GstElement *)> &setup = nullptr) {
+    GError *err = nullptr;
+    GstElement *pipeline = gst_parse_launch(description.c_str(), &err);
+    if (!pipeline) {
+        fmt::print(stderr, "unable to build pipeline: {}\n",
+                   err ? err->message : "unknown error");
+        g_clear_error(&err);
+        return false;
+    }
+
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
+    if (encoder) {
+        GstPad *src_pad = gst_element_get_static_pad(encoder, "src");
+        gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, cb_count_bytes,
+                          &result.encoded_bytes, nullptr);
+        gst_object_unref(src_pad);
+        gst_object_unref(encoder);
+    }
+    if (setup) {
+        setup(pipeline);
+    }
+
+    double cpu_begin = cpu_time_seconds();
+    auto wall_begin = std::chrono::steady_clock::now();
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(
+        bus, GST_CLOCK_TIME_NONE,
+        (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+
+    result.wall_seconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - wall_begin)
+                              .count();
+    result.cpu_seconds = cpu_time_seconds() - cpu_begin;
+
+    bool ok = msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (msg) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return ok;
+}
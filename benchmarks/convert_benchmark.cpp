@@ -0,0 +1,92 @@
+#include <fmt/core.h>
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "benchmark_common.hpp"
+#include "color_convert.hpp"
+
+// Compares the built-in RGB to I420 kernels of every instruction set the CPU
+// supports with videoconvert, all on a single thread.
+//
+// usage: convert_benchmark [width] [height] [frames]
+
+static const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::Sse41,
+                                   SimdLevel::Avx2};
+
+static void print_result(const char *label, uint frames, double seconds,
+                         double reference_seconds) {
+    fmt::print("{:<16} {:>9.3f} {:>9.1f} {:>8.2f}x\n", label,
+               seconds * 1000.0 / frames, frames / seconds,
+               reference_seconds / seconds);
+}
+
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+
+    uint width = argc > 1 ? std::atoi(argv[1]) : 1920;
+    uint height = argc > 2 ? std::atoi(argv[2]) : 1080;
+    uint frames = argc > 3 ? std::atoi(argv[3]) : 300;
+
+    // videoconvert is timed on the generated clip, minus the cost of
+    // generating it
+    PassResult baseline, videoconvert;
+    if (!run_pass(source_description(width, height, frames, "RGB") +
+                      " ! fakesink sync=false",
+                  baseline) ||
+        !run_pass(source_description(width, height, frames, "RGB") +
+                      " ! videoconvert n-threads=1 "
+                      "! video/x-raw,format=I420 ! fakesink sync=false",
+                  videoconvert)) {
+        fmt::print(stderr, "unable to run videoconvert passes\n");
+        return 1;
+    }
+    double videoconvert_seconds =
+        std::max(videoconvert.wall_seconds - baseline.wall_seconds, 1e-9);
+
+    // Noise defeats any shortcut a kernel could take on flat areas
+    std::vector<uint8_t> rgb((size_t)width * height * 3);
+    std::mt19937 random(42);
+    for (uint8_t &byte : rgb) {
+        byte = (uint8_t)random();
+    }
+    uint chroma_width = (width + 1) / 2;
+    uint chroma_height = (height + 1) / 2;
+    std::vector<uint8_t> i420((size_t)width * height +
+                              2 * (size_t)chroma_width * chroma_height);
+    uint8_t *y = i420.data();
+    uint8_t *u = y + (size_t)width * height;
+    uint8_t *v = u + (size_t)chroma_width * chroma_height;
+
+    fmt::print("{}x{}, {} frames, best kernel {}\n", width, height, frames,
+               simd_level_name(best_simd_level()));
+    fmt::print("{:<16} {:>9} {:>9} {:>9}\n", "converter", "ms/frame", "fps",
+               "speedup");
+    print_result("videoconvert", frames, videoconvert_seconds,
+                 videoconvert_seconds);
+
+    for (SimdLevel level : levels) {
+        RgbToI420Kernel kernel = get_rgb_to_i420_kernel(level);
+        if (!kernel) {
+            fmt::print("{:<16} not supported\n", simd_level_name(level));
+            continue;
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        for (uint frame = 0; frame < frames; frame++) {
+            kernel(rgb.data(), width * 3, ChannelOrder::RGB, width, height, y,
+                   width, u, chroma_width, v, chroma_width);
+        }
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+        print_result(simd_level_name(level), frames, seconds,
+                     videoconvert_seconds);
+    }
+
+    return 0;
+}
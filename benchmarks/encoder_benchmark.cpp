@@ -0,0 +1,189 @@
+#include <fmt/core.h>
+#include <gst/app/gstappsink.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+#include "benchmark_common.hpp"
+#include "encoder.hpp"
+
+// Encodes the same synthetic clip with every installed encoder profile and
+// reports throughput, CPU usage, achieved bitrate and luma PSNR.
+//
+// usage: encoder_benchmark [width] [height] [frames] [bitrate_kbps]
+
+static const VideoEncoder encoders[] = {
+    VideoEncoder::X264, VideoEncoder::X265,   VideoEncoder::OpenH264,
+    VideoEncoder::VP8,  VideoEncoder::VP9,    VideoEncoder::SvtAv1,
+    VideoEncoder::Rav1e, VideoEncoder::VaapiH264,
+};
+
+/**
+ * @brief Sums the squared luma difference of two I420 samples.
+ */
+static bool luma_squared_error(GstSample *reference, GstSample *decoded,
+                               double &squared_error, guint64 &pixels) {
+    GstVideoInfo reference_info, decoded_info;
+    if (!gst_video_info_from_caps(&reference_info,
+                                  gst_sample_get_caps(reference)) ||
+        !gst_video_info_from_caps(&decoded_info,
+                                  gst_sample_get_caps(decoded))) {
+        return false;
+    }
+
+    GstVideoFrame reference_frame, decoded_frame;
+    if (!gst_video_frame_map(&reference_frame, &reference_info,
+                             gst_sample_get_buffer(reference), GST_MAP_READ)) {
+        return false;
+    }
+    if (!gst_video_frame_map(&decoded_frame, &decoded_info,
+                             gst_sample_get_buffer(decoded), GST_MAP_READ)) {
+        gst_video_frame_unmap(&reference_frame);
+        return false;
+    }
+
+    int width = GST_VIDEO_FRAME_WIDTH(&reference_frame);
+    int height = GST_VIDEO_FRAME_HEIGHT(&reference_frame);
+    for (int y = 0; y < height; y++) {
+        const guint8 *a =
+            (const guint8 *)GST_VIDEO_FRAME_PLANE_DATA(&reference_frame, 0) +
+            y * GST_VIDEO_FRAME_PLANE_STRIDE(&reference_frame, 0);
+        const guint8 *b =
+            (const guint8 *)GST_VIDEO_FRAME_PLANE_DATA(&decoded_frame, 0) +
+            y * GST_VIDEO_FRAME_PLANE_STRIDE(&decoded_frame, 0);
+        for (int x = 0; x < width; x++) {
+            double diff = (double)a[x] - (double)b[x];
+            squared_error += diff * diff;
+        }
+    }
+    pixels += (guint64)width * height;
+
+    gst_video_frame_unmap(&decoded_frame);
+    gst_video_frame_unmap(&reference_frame);
+    return true;
+}
+
+/**
+ * @brief Encodes and decodes the clip and returns the luma PSNR in dB, or a
+ * negative value if no decoder is available.
+ */
+static double measure_psnr(const EncoderSettings &settings, uint width,
+                           uint height, uint frames) {
+    auto description = fmt::format(
+        "{} ! tee name=t "
+        "t. ! queue max-size-buffers=120 max-size-bytes=0 max-size-time=0 "
+        "! appsink name=reference sync=false "
+        "t. ! queue ! {} ! decodebin ! videoconvert "
+        "! video/x-raw,format=I420 ! appsink name=decoded sync=false",
+        source_description(width, height, frames),
+        encoder_description(settings, "encoder"));
+
+    GstElement *pipeline = gst_parse_launch(description.c_str(), nullptr);
+    if (!pipeline) {
+        return -1.0;
+    }
+    GstElement *reference = gst_bin_get_by_name(GST_BIN(pipeline), "reference");
+    GstElement *decoded = gst_bin_get_by_name(GST_BIN(pipeline), "decoded");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    double squared_error = 0.0;
+    guint64 pixels = 0;
+    GstSample *decoded_sample;
+    while ((decoded_sample = gst_app_sink_pull_sample(GST_APP_SINK(decoded)))) {
+        GstClockTime pts = GST_BUFFER_PTS(gst_sample_get_buffer(decoded_sample));
+
+        // Frames dropped by the encoder have no decoded counterpart
+        GstSample *reference_sample;
+        while ((reference_sample =
+                    gst_app_sink_pull_sample(GST_APP_SINK(reference)))) {
+            GstClockTime reference_pts =
+                GST_BUFFER_PTS(gst_sample_get_buffer(reference_sample));
+            if (reference_pts >= pts) {
+                break;
+            }
+            gst_sample_unref(reference_sample);
+        }
+        if (!reference_sample) {
+            gst_sample_unref(decoded_sample);
+            break;
+        }
+
+        luma_squared_error(reference_sample, decoded_sample, squared_error,
+                           pixels);
+        gst_sample_unref(reference_sample);
+        gst_sample_unref(decoded_sample);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(reference);
+    gst_object_unref(decoded);
+    gst_object_unref(pipeline);
+
+    if (pixels == 0) {
+        return -1.0;
+    }
+    double mse = squared_error / pixels;
+    return mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+
+    uint width = argc > 1 ? std::atoi(argv[1]) : 1920;
+    uint height = argc > 2 ? std::atoi(argv[2]) : 1080;
+    uint frames = argc > 3 ? std::atoi(argv[3]) : 300;
+    uint bitrate_kbps = argc > 4 ? std::atoi(argv[4]) : 3500;
+
+    // The cost of generating the clip is subtracted from every encoder
+    PassResult baseline;
+    if (!run_pass(source_description(width, height, frames) +
+                      " ! fakesink sync=false",
+                  baseline)) {
+        fmt::print(stderr, "unable to run baseline pass\n");
+        return 1;
+    }
+
+    fmt::print("{}x{}, {} frames at {} fps, target {} kbit/s\n", width, height,
+               frames, FRAME_RATE, bitrate_kbps);
+    fmt::print("{:<12} {:>8} {:>7} {:>9} {:>9} {:>8}\n", "encoder", "fps",
+               "cores", "fps/core", "kbit/s", "psnr-y");
+
+    for (VideoEncoder encoder : encoders) {
+        if (!is_encoder_available(encoder)) {
+            fmt::print("{:<12} not installed\n", encoder_name(encoder));
+            continue;
+        }
+
+        EncoderSettings settings;
+        settings.backend = encoder;
+        settings.bitrate_kbps = bitrate_kbps;
+
+        PassResult result;
+        auto description = fmt::format(
+            "{} ! {} ! fakesink sync=false",
+            source_description(width, height, frames),
+            encoder_description(settings, "encoder"));
+        if (!run_pass(description, result)) {
+            fmt::print("{:<12} failed\n", encoder_name(encoder));
+            continue;
+        }
+
+        double wall = result.wall_seconds;
+        double cpu = std::max(result.cpu_seconds - baseline.cpu_seconds, 1e-9);
+        double kbps = result.encoded_bytes * 8.0 / 1000.0 /
+                      ((double)frames / FRAME_RATE);
+        double psnr = measure_psnr(settings, width, height, frames);
+
+        fmt::print("{:<12} {:>8.1f} {:>7.2f} {:>9.1f} {:>9.0f} {:>8}\n",
+                   encoder_name(encoder), frames / wall, cpu / wall,
+                   frames / cpu, kbps,
+                   psnr < 0.0 ? std::string("n/a")
+                              : fmt::format("{:.2f}", psnr));
+    }
+
+    return 0;
+}
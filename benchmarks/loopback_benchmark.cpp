@@ -0,0 +1,159 @@
+#include <fmt/core.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <opencv2/imgproc.hpp>
+#include <thread>
+
+#include "benchmark_common.hpp"
+#include "rtmp.hpp"
+#include "rtmp_test_server.hpp"
+
+// Streams synthetic frames through a complete RtmpStreamer into the loopback
+// RTMP server, and reports what arrived at the server and the latency of
+// every stage, from the timestamps embedded into the frames. The connection
+// is then dropped by the server to measure the reconnection.
+//
+// usage: loopback_benchmark [width] [height] [seconds] [bitrate_kbps]
+
+struct Phase {
+    uint frames_sent = 0;
+    double wall_seconds = 0.0;
+};
+
+static Phase stream_frames(RtmpStreamer &streamer, cv::Mat &frame,
+                           double seconds, uint &frame_number) {
+    Phase phase;
+    auto frame_interval = std::chrono::microseconds(1000000 / FRAME_RATE);
+    auto begin = std::chrono::steady_clock::now();
+    auto next_frame = begin;
+
+    while (std::chrono::steady_clock::now() - begin <
+           std::chrono::duration<double>(seconds)) {
+        // A moving block over a slowly changing background keeps the
+        // encoder busy with motion in every frame
+        frame.setTo(cv::Scalar(frame_number % 256, 96, 160));
+        int x = (frame_number * 8) % std::max(1, frame.cols - frame.cols / 8);
+        cv::rectangle(frame,
+                      cv::Rect(x, frame.rows / 3, frame.cols / 8,
+                               frame.rows / 3),
+                      cv::Scalar(255, 255, 255), cv::FILLED);
+        if (streamer.send_frame(frame)) {
+            phase.frames_sent++;
+        }
+        frame_number++;
+
+        next_frame += frame_interval;
+        std::this_thread::sleep_until(next_frame);
+    }
+
+    phase.wall_seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+    return phase;
+}
+
+/**
+ * @brief Latency of the frames received by the server, fed from its thread.
+ */
+struct LatencyProbe {
+    std::mutex mutex;
+    LatencyRecorder recorder;
+    uint64_t frames_without_timestamps = 0;
+};
+
+static void print_percentiles(const char *stage,
+                              const LatencyPercentiles &latency) {
+    fmt::print("  {:<12} {:>9.2f} {:>9.2f} {:>9.2f} {:>9.2f}\n", stage,
+               latency.p50_ms, latency.p99_ms, latency.p999_ms,
+               latency.max_ms);
+}
+
+static void print_latency(LatencyProbe &probe) {
+    std::lock_guard<std::mutex> guard(probe.mutex);
+    LatencyReport report = probe.recorder.report();
+    fmt::print("  {} frames with timestamps, {} without, {} missing IDs\n",
+               report.frames, probe.frames_without_timestamps,
+               report.missing_frames);
+    fmt::print("  {:<12} {:>9} {:>9} {:>9} {:>9}\n", "stage ms", "p50", "p99",
+               "p999", "max");
+    print_percentiles("pre-encode", report.pre_encode);
+    print_percentiles("encode", report.encode);
+    print_percentiles("delivery", report.delivery);
+    print_percentiles("end to end", report.end_to_end);
+
+    probe.recorder.clear();
+    probe.frames_without_timestamps = 0;
+}
+
+static void print_phase(const char *label, const Phase &phase,
+                        const RtmpServerStats &before,
+                        const RtmpServerStats &after) {
+    uint64_t frames = after.video_frames - before.video_frames;
+    uint64_t video_bytes = after.video_bytes - before.video_bytes;
+    fmt::print("{:<10} {:>7} {:>9} {:>7.1f} {:>9.0f} {:>6} {:>8}\n", label,
+               phase.frames_sent, frames, frames / phase.wall_seconds,
+               video_bytes * 8.0 / 1000.0 / phase.wall_seconds,
+               after.keyframes - before.keyframes, after.max_timestamp_gap_ms);
+}
+
+int main(int argc, char *argv[]) {
+    uint width = argc > 1 ? std::atoi(argv[1]) : 1280;
+    uint height = argc > 2 ? std::atoi(argv[2]) : 720;
+    double seconds = argc > 3 ? std::atof(argv[3]) : 10.0;
+    uint bitrate_kbps = argc > 4 ? std::atoi(argv[4]) : 3500;
+
+    // The server runs in the same process, so both ends share one clock
+    LatencyProbe probe;
+    RtmpTestServer server;
+    server.set_video_callback([&probe](const RtmpVideoFrame &frame) {
+        int64_t arrival_us = wall_clock_us();
+        std::lock_guard<std::mutex> guard(probe.mutex);
+        if (!probe.recorder.add(frame.data, frame.size, 4, arrival_us)) {
+            probe.frames_without_timestamps++;
+        }
+    });
+    if (!server.start()) {
+        return 1;
+    }
+
+    StreamerConfig config;
+    config.encoder.bitrate_kbps = bitrate_kbps;
+    config.embed_timestamps = true;
+    RtmpStreamer streamer(width, height, server.url().c_str(), config);
+    streamer.start_rtmp_stream();
+
+    cv::Mat frame(height, width, CV_8UC3);
+    uint frame_number = 0;
+
+    fmt::print("{}x{} at {} fps, target {} kbit/s, {}\n", width, height,
+               FRAME_RATE, bitrate_kbps, server.url());
+    fmt::print("{:<10} {:>7} {:>9} {:>7} {:>9} {:>6} {:>8}\n", "phase", "sent",
+               "received", "fps", "kbit/s", "keys", "max gap");
+
+    RtmpServerStats before = server.stats();
+    Phase steady = stream_frames(streamer, frame, seconds, frame_number);
+    RtmpServerStats after_steady = server.stats();
+    print_phase("steady", steady, before, after_steady);
+    print_latency(probe);
+
+    // The server closes the socket as a failing network would, the
+    // streamer has to notice and publish again on its own
+    server.drop_connection();
+    Phase reconnect = stream_frames(streamer, frame, seconds, frame_number);
+    RtmpServerStats after_reconnect = server.stats();
+    print_phase("reconnect", reconnect, after_steady, after_reconnect);
+    print_latency(probe);
+
+    StreamerMetrics metrics = streamer.get_metrics();
+    fmt::print("\npublishes {}, reconnect attempts {}, reconnects {}, "
+               "downtime {:.0f} ms, replayed frames {}\n",
+               after_reconnect.publishes, metrics.rtmp_reconnect_attempts,
+               metrics.rtmp_reconnects, metrics.rtmp_last_downtime_ms,
+               metrics.rtmp_replayed_frames);
+
+    streamer.stop_rtmp_stream();
+    server.stop();
+    return 0;
+}
@@ -0,0 +1,658 @@
+#include "rtmp_test_server.hpp"
+
+#include <arpa/inet.h>
+#include <fmt/core.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <random>
+#include <vector>
+
+#define HANDSHAKE_SIZE 1536
+#define DEFAULT_CHUNK_SIZE 128
+#define WINDOW_ACK_SIZE 2500000
+#define ACCEPT_POLL_MS 100
+
+#define MSG_SET_CHUNK_SIZE 1
+#define MSG_ACKNOWLEDGEMENT 3
+#define MSG_WINDOW_ACK_SIZE 5
+#define MSG_SET_PEER_BANDWIDTH 6
+#define MSG_AUDIO 8
+#define MSG_VIDEO 9
+#define MSG_DATA_AMF0 18
+#define MSG_COMMAND_AMF0 20
+
+#define AMF0_NUMBER 0x00
+#define AMF0_BOOLEAN 0x01
+#define AMF0_STRING 0x02
+#define AMF0_OBJECT 0x03
+#define AMF0_NULL 0x05
+#define AMF0_UNDEFINED 0x06
+#define AMF0_ECMA_ARRAY 0x08
+#define AMF0_OBJECT_END 0x09
+#define AMF0_STRICT_ARRAY 0x0a
+#define AMF0_DATE 0x0b
+#define AMF0_LONG_STRING 0x0c
+
+#define FLV_CODEC_H264 7
+#define FLV_FRAME_KEY 1
+#define FLV_AVC_NALU 1
+
+static uint32_t read_be(const uint8_t *data, size_t bytes) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value = value << 8 | data[i];
+    }
+    return value;
+}
+
+static void append_be(std::vector<uint8_t> &out, uint32_t value,
+                      size_t bytes) {
+    for (size_t i = bytes; i > 0; i--) {
+        out.push_back((uint8_t)(value >> (8 * (i - 1))));
+    }
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+/**
+ * @brief Buffered reads of exact sizes from the client socket.
+ */
+class SocketReader {
+   public:
+    explicit SocketReader(int fd) : fd(fd) {}
+
+    bool read(uint8_t *dst, size_t size) {
+        while (size > 0) {
+            if (begin == end) {
+                ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+                if (received <= 0) {
+                    return false;
+                }
+                total += received;
+                begin = 0;
+                end = received;
+            }
+            size_t count = std::min(size, end - begin);
+            memcpy(dst, buffer + begin, count);
+            begin += count;
+            dst += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Bytes received from the socket so far.
+     */
+    uint64_t total = 0;
+
+   private:
+    int fd;
+    uint8_t buffer[65536];
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+/**
+ * @brief The scalar AMF0 values a command is made of. Objects and arrays are
+ * skipped and only their type is kept.
+ */
+struct AmfValue {
+    uint8_t type = AMF0_UNDEFINED;
+    double number = 0.0;
+    std::string string;
+};
+
+class AmfReader {
+   public:
+    AmfReader(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+    bool read(AmfValue &value) {
+        if (pos >= size) {
+            return false;
+        }
+        value = {};
+        value.type = data[pos++];
+        switch (value.type) {
+            case AMF0_NUMBER: {
+                if (pos + 8 > size) {
+                    return false;
+                }
+                uint64_t bits = (uint64_t)read_be(data + pos, 4) << 32 |
+                                read_be(data + pos + 4, 4);
+                memcpy(&value.number, &bits, sizeof(bits));
+                pos += 8;
+                return true;
+            }
+            case AMF0_BOOLEAN:
+                if (pos + 1 > size) {
+                    return false;
+                }
+                value.number = data[pos++];
+                return true;
+            case AMF0_STRING:
+                return read_string(2, value.string);
+            case AMF0_LONG_STRING:
+                return read_string(4, value.string);
+            case AMF0_NULL:
+            case AMF0_UNDEFINED:
+                return true;
+            case AMF0_OBJECT:
+                return skip_properties();
+            case AMF0_ECMA_ARRAY:
+                pos += 4;
+                return skip_properties();
+            case AMF0_STRICT_ARRAY: {
+                if (pos + 4 > size) {
+                    return false;
+                }
+                uint32_t count = read_be(data + pos, 4);
+                pos += 4;
+                AmfValue element;
+                for (uint32_t i = 0; i < count; i++) {
+                    if (!read(element)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            case AMF0_DATE:
+                pos += 10;
+                return pos <= size;
+            default:
+                return false;
+        }
+    }
+
+   private:
+    bool read_string(size_t length_bytes, std::string &out) {
+        if (pos + length_bytes > size) {
+            return false;
+        }
+        size_t length = read_be(data + pos, length_bytes);
+        pos += length_bytes;
+        if (pos + length > size) {
+            return false;
+        }
+        out.assign((const char *)data + pos, length);
+        pos += length;
+        return true;
+    }
+
+    bool skip_properties() {
+        std::string key;
+        AmfValue value;
+        while (pos + 3 <= size) {
+            if (read_be(data + pos, 2) == 0 &&
+                data[pos + 2] == AMF0_OBJECT_END) {
+                pos += 3;
+                return true;
+            }
+            if (!read_string(2, key) || !read(value)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+};
+
+class AmfWriter {
+   public:
+    AmfWriter &number(double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        out.push_back(AMF0_NUMBER);
+        append_be(out, (uint32_t)(bits >> 32), 4);
+        append_be(out, (uint32_t)bits, 4);
+        return *this;
+    }
+
+    AmfWriter &string(const std::string &value) {
+        out.push_back(AMF0_STRING);
+        key(value);
+        return *this;
+    }
+
+    AmfWriter &null() {
+        out.push_back(AMF0_NULL);
+        return *this;
+    }
+
+    AmfWriter &begin_object() {
+        out.push_back(AMF0_OBJECT);
+        return *this;
+    }
+
+    /**
+     * @brief Writes the name of an object property, its value follows.
+     */
+    AmfWriter &key(const std::string &name) {
+        append_be(out, (uint32_t)name.size(), 2);
+        out.insert(out.end(), name.begin(), name.end());
+        return *this;
+    }
+
+    AmfWriter &end_object() {
+        append_be(out, 0, 2);
+        out.push_back(AMF0_OBJECT_END);
+        return *this;
+    }
+
+    std::vector<uint8_t> out;
+};
+
+/**
+ * @brief Writes a message with a type 0 header, split into chunks of the
+ * default size.
+ */
+static bool send_message(int fd, uint8_t chunk_stream_id, uint8_t type,
+                         uint32_t stream_id,
+                         const std::vector<uint8_t> &payload) {
+    std::vector<uint8_t> out;
+    out.push_back(chunk_stream_id);
+    append_be(out, 0, 3);
+    append_be(out, (uint32_t)payload.size(), 3);
+    out.push_back(type);
+    for (int i = 0; i < 4; i++) {
+        out.push_back((uint8_t)(stream_id >> (8 * i)));
+    }
+    for (size_t offset = 0; offset < payload.size();
+         offset += DEFAULT_CHUNK_SIZE) {
+        if (offset > 0) {
+            out.push_back(0xc0 | chunk_stream_id);
+        }
+        size_t count =
+            std::min((size_t)DEFAULT_CHUNK_SIZE, payload.size() - offset);
+        out.insert(out.end(), payload.begin() + offset,
+                   payload.begin() + offset + count);
+    }
+    return write_all(fd, out.data(), out.size());
+}
+
+static bool send_control(int fd, uint8_t type, uint32_t value,
+                         int extra_byte = -1) {
+    std::vector<uint8_t> payload;
+    append_be(payload, value, 4);
+    if (extra_byte >= 0) {
+        payload.push_back((uint8_t)extra_byte);
+    }
+    return send_message(fd, 2, type, 0, payload);
+}
+
+static bool send_status(int fd, uint32_t stream_id, const char *code,
+                        const char *description) {
+    AmfWriter amf;
+    amf.string("onStatus").number(0).null().begin_object();
+    amf.key("level").string("status");
+    amf.key("code").string(code);
+    amf.key("description").string(description);
+    amf.end_object();
+    return send_message(fd, 5, MSG_COMMAND_AMF0, stream_id, amf.out);
+}
+
+/**
+ * @brief State of one chunk stream of the client.
+ */
+struct ChunkStream {
+    uint32_t timestamp = 0;
+    uint32_t timestamp_delta = 0;
+    uint32_t length = 0;
+    uint8_t type = 0;
+    uint32_t stream_id = 0;
+    bool extended_timestamp = false;
+    std::vector<uint8_t> payload;
+};
+
+RtmpTestServer::~RtmpTestServer() { stop(); }
+
+bool RtmpTestServer::start(uint16_t port) {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0 ||
+        getsockname(listen_fd, (sockaddr *)&addr, &addr_len) < 0) {
+        fmt::print(stderr, "unable to listen on port {}: {}\n", port,
+                   strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    listen_port = ntohs(addr.sin_port);
+
+    running = true;
+    server_thread = std::thread(&RtmpTestServer::accept_loop, this);
+    return true;
+}
+
+void RtmpTestServer::stop() {
+    running = false;
+    drop_connection();
+    if (server_thread.joinable()) {
+        server_thread.join();
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
+
+void RtmpTestServer::drop_connection() {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (client_fd >= 0) {
+        shutdown(client_fd, SHUT_RDWR);
+    }
+}
+
+std::string RtmpTestServer::url(const std::string &stream_key) const {
+    return fmt::format("rtmp://127.0.0.1:{}/live/{}", listen_port,
+                       stream_key);
+}
+
+RtmpServerStats RtmpTestServer::stats() const {
+    std::lock_guard<std::mutex> guard(mutex);
+    return server_stats;
+}
+
+void RtmpTestServer::set_video_callback(RtmpVideoCallback callback) {
+    video_callback = std::move(callback);
+}
+
+void RtmpTestServer::accept_loop() {
+    while (running) {
+        pollfd listen_poll = {listen_fd, POLLIN, 0};
+        if (poll(&listen_poll, 1, ACCEPT_POLL_MS) <= 0) {
+            continue;
+        }
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            client_fd = fd;
+            server_stats.connections++;
+        }
+
+        serve(fd);
+
+        std::lock_guard<std::mutex> guard(mutex);
+        client_fd = -1;
+        close(fd);
+    }
+}
+
+void RtmpTestServer::serve(int fd) {
+    SocketReader reader(fd);
+    uint64_t counted_bytes = 0;
+    auto count_bytes = [&]() {
+        std::lock_guard<std::mutex> guard(mutex);
+        server_stats.bytes += reader.total - counted_bytes;
+        counted_bytes = reader.total;
+    };
+
+    // Plain handshake: S1 is random and S2 echoes C1
+    std::vector<uint8_t> c0c1(1 + HANDSHAKE_SIZE);
+    if (!reader.read(c0c1.data(), c0c1.size())) {
+        return;
+    }
+    std::vector<uint8_t> s0s1s2(1 + 2 * HANDSHAKE_SIZE, 0);
+    s0s1s2[0] = 3;
+    std::mt19937 random(std::random_device{}());
+    for (size_t i = 9; i < 1 + HANDSHAKE_SIZE; i++) {
+        s0s1s2[i] = (uint8_t)random();
+    }
+    std::copy(c0c1.begin() + 1, c0c1.end(),
+              s0s1s2.begin() + 1 + HANDSHAKE_SIZE);
+    std::vector<uint8_t> c2(HANDSHAKE_SIZE);
+    if (!write_all(fd, s0s1s2.data(), s0s1s2.size()) ||
+        !reader.read(c2.data(), c2.size())) {
+        return;
+    }
+    count_bytes();
+
+    std::map<uint32_t, ChunkStream> chunk_streams;
+    uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+    uint32_t ack_window = 0;
+    uint64_t acked_bytes = 0;
+    uint publish = 0;
+    bool first_frame = true;
+
+    auto handle_message = [&](const ChunkStream &message) -> bool {
+        const uint8_t *payload = message.payload.data();
+        size_t size = message.payload.size();
+
+        switch (message.type) {
+            case MSG_SET_CHUNK_SIZE:
+                if (size >= 4) {
+                    chunk_size = read_be(payload, 4) & 0x7fffffff;
+                }
+                return true;
+            case MSG_WINDOW_ACK_SIZE:
+                if (size >= 4) {
+                    ack_window = read_be(payload, 4);
+                }
+                return true;
+            case MSG_AUDIO: {
+                std::lock_guard<std::mutex> guard(mutex);
+                server_stats.audio_frames++;
+                return true;
+            }
+            case MSG_DATA_AMF0: {
+                std::lock_guard<std::mutex> guard(mutex);
+                server_stats.metadata_tags++;
+                return true;
+            }
+            case MSG_VIDEO:
+                break;
+            case MSG_COMMAND_AMF0: {
+                AmfReader amf(payload, size);
+                AmfValue name, transaction, argument;
+                if (!amf.read(name) || !amf.read(transaction)) {
+                    return true;
+                }
+
+                if (name.string == "connect") {
+                    AmfWriter result;
+                    result.string("_result").number(transaction.number);
+                    result.begin_object();
+                    result.key("fmsVer").string("FMS/3,0,1,123");
+                    result.key("capabilities").number(31);
+                    result.end_object().begin_object();
+                    result.key("level").string("status");
+                    result.key("code").string("NetConnection.Connect.Success");
+                    result.key("description").string("Connection succeeded.");
+                    result.key("objectEncoding").number(0);
+                    result.end_object();
+                    return send_control(fd, MSG_WINDOW_ACK_SIZE,
+                                        WINDOW_ACK_SIZE) &&
+                           send_control(fd, MSG_SET_PEER_BANDWIDTH,
+                                        WINDOW_ACK_SIZE, 2) &&
+                           send_message(fd, 3, MSG_COMMAND_AMF0, 0,
+                                        result.out);
+                }
+                if (name.string == "createStream") {
+                    AmfWriter result;
+                    result.string("_result").number(transaction.number);
+                    result.null().number(1);
+                    return send_message(fd, 3, MSG_COMMAND_AMF0, 0,
+                                        result.out);
+                }
+                if (name.string == "publish") {
+                    AmfValue stream_key;
+                    if (!amf.read(argument) || !amf.read(stream_key)) {
+                        return false;
+                    }
+                    {
+                        std::lock_guard<std::mutex> guard(mutex);
+                        publish = ++server_stats.publishes;
+                        server_stats.stream_key = stream_key.string;
+                    }
+                    first_frame = true;
+                    return send_status(fd, message.stream_id,
+                                       "NetStream.Publish.Start",
+                                       "Start publishing");
+                }
+                // releaseStream, FCPublish and the teardown commands need
+                // no answer
+                return true;
+            }
+            default:
+                return true;
+        }
+
+        if (size < 1) {
+            return true;
+        }
+        RtmpVideoFrame frame = {};
+        frame.timestamp_ms = message.timestamp;
+        frame.keyframe = payload[0] >> 4 == FLV_FRAME_KEY;
+        frame.data = payload + 1;
+        frame.size = size - 1;
+        frame.arrival = std::chrono::steady_clock::now();
+        frame.publish = publish;
+        if ((payload[0] & 0x0f) == FLV_CODEC_H264) {
+            // Sequence headers and end of sequence carry no frame
+            if (size < 5 || payload[1] != FLV_AVC_NALU) {
+                return true;
+            }
+            frame.composition_time_ms =
+                (int32_t)(read_be(payload + 2, 3) << 8) >> 8;
+            frame.data = payload + 5;
+            frame.size = size - 5;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            server_stats.video_frames++;
+            server_stats.keyframes += frame.keyframe;
+            server_stats.video_bytes += frame.size;
+            if (first_frame) {
+                server_stats.first_timestamp_ms = frame.timestamp_ms;
+            } else {
+                server_stats.max_timestamp_gap_ms =
+                    std::max(server_stats.max_timestamp_gap_ms,
+                             frame.timestamp_ms -
+                                 server_stats.last_timestamp_ms);
+            }
+            server_stats.last_timestamp_ms = frame.timestamp_ms;
+        }
+        first_frame = false;
+
+        if (video_callback) {
+            video_callback(frame);
+        }
+        return true;
+    };
+
+    uint8_t basic_header;
+    while (reader.read(&basic_header, 1)) {
+        uint8_t format = basic_header >> 6;
+        uint32_t chunk_stream_id = basic_header & 0x3f;
+        uint8_t extra[2];
+        if (chunk_stream_id == 0) {
+            if (!reader.read(extra, 1)) {
+                break;
+            }
+            chunk_stream_id = 64 + extra[0];
+        } else if (chunk_stream_id == 1) {
+            if (!reader.read(extra, 2)) {
+                break;
+            }
+            chunk_stream_id = 64 + extra[0] + extra[1] * 256;
+        }
+        ChunkStream &stream = chunk_streams[chunk_stream_id];
+
+        static const size_t header_sizes[] = {11, 7, 3, 0};
+        uint8_t header[11];
+        if (!reader.read(header, header_sizes[format])) {
+            break;
+        }
+        uint32_t timestamp_field = 0;
+        if (format <= 2) {
+            timestamp_field = read_be(header, 3);
+            stream.extended_timestamp = timestamp_field == 0xffffff;
+        }
+        if (format <= 1) {
+            stream.length = read_be(header + 3, 3);
+            stream.type = header[6];
+        }
+        if (format == 0) {
+            stream.stream_id = header[7] | header[8] << 8 | header[9] << 16 |
+                               (uint32_t)header[10] << 24;
+        }
+        // Type 3 chunks repeat the extended timestamp of their stream
+        if (stream.extended_timestamp) {
+            uint8_t extended[4];
+            if (!reader.read(extended, 4)) {
+                break;
+            }
+            timestamp_field = read_be(extended, 4);
+        }
+
+        if (stream.payload.empty()) {
+            if (format == 0) {
+                stream.timestamp_delta = timestamp_field - stream.timestamp;
+                stream.timestamp = timestamp_field;
+            } else if (format <= 2) {
+                stream.timestamp_delta = timestamp_field;
+                stream.timestamp += timestamp_field;
+            } else {
+                stream.timestamp += stream.timestamp_delta;
+            }
+        }
+
+        size_t offset = stream.payload.size();
+        size_t count = std::min((size_t)chunk_size, stream.length - offset);
+        stream.payload.resize(offset + count);
+        if (!reader.read(stream.payload.data() + offset, count)) {
+            break;
+        }
+        if (stream.payload.size() == stream.length) {
+            bool ok = handle_message(stream);
+            stream.payload.clear();
+            if (!ok) {
+                break;
+            }
+        }
+
+        if (ack_window > 0 && reader.total - acked_bytes >= ack_window) {
+            acked_bytes = reader.total;
+            send_control(fd, MSG_ACKNOWLEDGEMENT, (uint32_t)acked_bytes);
+        }
+        count_bytes();
+    }
+    count_bytes();
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// A minimal RTMP server for the benchmarks, so the output of rtmp2sink can be
+// measured on the loopback interface without a real server. It accepts one
+// publishing client at a time, demuxes the FLV tags it sends and counts them.
+// Only what rtmp2sink needs is implemented: the plain handshake, chunking in
+// both directions and the connect, createStream and publish commands.
+
+/**
+ * @brief A video tag received from the publishing client.
+ */
+struct RtmpVideoFrame {
+    /**
+     * @brief Decode timestamp of the tag in milliseconds.
+     */
+    uint32_t timestamp_ms;
+
+    /**
+     * @brief Offset of the presentation timestamp from the decode
+     * timestamp in milliseconds, 0 for codecs other than H.264.
+     */
+    int32_t composition_time_ms;
+
+    /**
+     * @brief Flag indicating whether the tag holds a keyframe.
+     */
+    bool keyframe;
+
+    /**
+     * @brief The codec payload after the FLV video tag header, for H.264
+     * length prefixed NAL units.
+     */
+    const uint8_t *data;
+
+    /**
+     * @brief Size of `data` in bytes.
+     */
+    size_t size;
+
+    /**
+     * @brief When the last byte of the tag was received.
+     */
+    std::chrono::steady_clock::time_point arrival;
+
+    /**
+     * @brief Number of the publish the tag belongs to, starting at 1.
+     */
+    uint publish;
+};
+
+/**
+ * @brief Called on the server thread for every video frame.
+ */
+using RtmpVideoCallback = std::function<void(const RtmpVideoFrame &frame)>;
+
+/**
+ * @brief Counters of everything the server received since it started.
+ */
+struct RtmpServerStats {
+    /**
+     * @brief Number of accepted TCP connections.
+     */
+    uint connections = 0;
+
+    /**
+     * @brief Number of publish commands that were accepted.
+     */
+    uint publishes = 0;
+
+    /**
+     * @brief Bytes received over all connections, including the handshake.
+     */
+    uint64_t bytes = 0;
+
+    /**
+     * @brief Number of coded video frames, not counting codec headers.
+     */
+    uint64_t video_frames = 0;
+
+    /**
+     * @brief Number of video keyframes.
+     */
+    uint64_t keyframes = 0;
+
+    /**
+     * @brief Bytes of the coded video frames.
+     */
+    uint64_t video_bytes = 0;
+
+    /**
+     * @brief Number of audio tags.
+     */
+    uint64_t audio_frames = 0;
+
+    /**
+     * @brief Number of metadata tags.
+     */
+    uint64_t metadata_tags = 0;
+
+    /**
+     * @brief Timestamp of the first video frame of the current publish in
+     * milliseconds.
+     */
+    uint32_t first_timestamp_ms = 0;
+
+    /**
+     * @brief Timestamp of the last video frame in milliseconds.
+     */
+    uint32_t last_timestamp_ms = 0;
+
+    /**
+     * @brief Largest step between the timestamps of two consecutive video
+     * frames of one publish, in milliseconds.
+     */
+    uint32_t max_timestamp_gap_ms = 0;
+
+    /**
+     * @brief The stream key of the last publish.
+     */
+    std::string stream_key;
+};
+
+class RtmpTestServer {
+   public:
+    RtmpTestServer() = default;
+    RtmpTestServer(const RtmpTestServer &) = delete;
+    RtmpTestServer &operator=(const RtmpTestServer &) = delete;
+    ~RtmpTestServer();
+
+    /**
+     * @brief Starts listening on the loopback interface.
+     *
+     * @param port The TCP port, 0 picks a free one.
+     * @return True if the server is listening; false otherwise.
+     */
+    bool start(uint16_t port = 0);
+
+    /**
+     * @brief Closes the connection and stops the server thread.
+     */
+    void stop();
+
+    /**
+     * @brief Closes the current connection, as if the network failed. The
+     * server keeps listening for the client to reconnect.
+     */
+    void drop_connection();
+
+    /**
+     * @brief Returns the address to publish to.
+     *
+     * @param stream_key The name of the stream.
+     * @return An rtmp:// URL on the loopback interface.
+     */
+    std::string url(const std::string &stream_key = "test") const;
+
+    /**
+     * @brief Returns the port the server listens on.
+     */
+    uint16_t port() const { return listen_port; }
+
+    /**
+     * @brief Returns a copy of the counters.
+     */
+    RtmpServerStats stats() const;
+
+    /**
+     * @brief Sets a callback receiving every video frame, must be set before
+     * `start`.
+     *
+     * @param callback The callback, may be empty.
+     */
+    void set_video_callback(RtmpVideoCallback callback);
+
+   private:
+    void accept_loop();
+    void serve(int fd);
+
+    int listen_fd = -1;
+    uint16_t listen_port = 0;
+    std::thread server_thread;
+    std::atomic<bool> running{false};
+
+    /**
+     * @brief The socket of the connected client, -1 if there is none.
+     */
+    int client_fd = -1;
+
+    /**
+     * @brief Guards `client_fd` and `server_stats`.
+     */
+    mutable std::mutex mutex;
+
+    RtmpServerStats server_stats;
+    RtmpVideoCallback video_callback;
+};
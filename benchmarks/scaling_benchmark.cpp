@@ -0,0 +1,92 @@
+#include <fmt/core.h>
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark_common.hpp"
+
+// Measures how videoconvert and videoscale scale with their n-threads
+// property, as used through StreamerConfig::convert_threads. Efficiency is
+// the speedup over one thread divided by the number of threads.
+//
+// usage: scaling_benchmark [width] [height] [frames]
+
+struct ScalingStage {
+    const char *element;
+    const char *input_format;
+    std::string output_caps;
+};
+
+static std::vector<uint> thread_counts() {
+    uint cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint> counts;
+    for (uint threads = 1; threads < cores; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(cores);
+    return counts;
+}
+
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+
+    uint width = argc > 1 ? std::atoi(argv[1]) : 3840;
+    uint height = argc > 2 ? std::atoi(argv[2]) : 2160;
+    uint frames = argc > 3 ? std::atoi(argv[3]) : 150;
+
+    // The same conversions the source bin and the RTMP bin run at 4K: RGB
+    // ingest to I420, and a downscale to half the resolution
+    std::vector<ScalingStage> stages = {
+        {"videoconvert", "RGB", "video/x-raw,format=I420"},
+        {"videoscale", "I420",
+         fmt::format("video/x-raw,width={},height={}", width / 2,
+                     height / 2)},
+    };
+
+    fmt::print("{}x{}, {} frames\n", width, height, frames);
+    fmt::print("{:<14} {:>8} {:>9} {:>9} {:>8} {:>11}\n", "element",
+               "threads", "ms/frame", "fps", "speedup", "efficiency");
+
+    for (const ScalingStage &stage : stages) {
+        // The cost of generating the clip is subtracted from every pass
+        PassResult baseline;
+        if (!run_pass(source_description(width, height, frames,
+                                         stage.input_format) +
+                          " ! fakesink sync=false",
+                      baseline)) {
+            fmt::print("{:<14} failed\n", stage.element);
+            continue;
+        }
+
+        double single_thread_seconds = 0.0;
+        for (uint threads : thread_counts()) {
+            PassResult result;
+            auto description = fmt::format(
+                "{} ! {} n-threads={} ! {} ! fakesink sync=false",
+                source_description(width, height, frames, stage.input_format),
+                stage.element, threads, stage.output_caps);
+            if (!run_pass(description, result)) {
+                fmt::print("{:<14} {:>8} failed\n", stage.element, threads);
+                continue;
+            }
+
+            double seconds =
+                std::max(result.wall_seconds - baseline.wall_seconds, 1e-9);
+            if (threads == 1) {
+                single_thread_seconds = seconds;
+            }
+            double speedup =
+                single_thread_seconds > 0.0 ? single_thread_seconds / seconds
+                                            : 0.0;
+            fmt::print("{:<14} {:>8} {:>9.2f} {:>9.1f} {:>7.2f}x {:>10.0f}%\n",
+                       stage.element, threads, seconds * 1000.0 / frames,
+                       frames / seconds, speedup, 100.0 * speedup / threads);
+        }
+    }
+
+    return 0;
+}
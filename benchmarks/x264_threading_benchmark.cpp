@@ -0,0 +1,177 @@
+#include <fmt/core.h>
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "benchmark_common.hpp"
+#include "encoder.hpp"
+
+// Encodes the synthetic clip with x264 under different threading and
+// lookahead settings and reports throughput and per-frame encoder latency,
+// to help pinning encoder threads per stream.
+//
+// usage: x264_threading_benchmark [width] [height] [frames] [bitrate_kbps]
+
+struct ThreadingCase {
+    const char *label;
+    X264Settings x264;
+};
+
+/**
+ * @brief Time each frame spends inside the encoder, matched by PTS.
+ */
+struct LatencyProbe {
+    std::mutex mutex;
+    std::map<GstClockTime, std::chrono::steady_clock::time_point> pending;
+    std::vector<double> latencies_ms;
+};
+
+static GstPadProbeReturn cb_frame_in(GstPad *pad, GstPadProbeInfo *info,
+                                     gpointer user_data) {
+    LatencyProbe *probe = (LatencyProbe *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    std::lock_guard<std::mutex> guard(probe->mutex);
+    probe->pending[pts] = std::chrono::steady_clock::now();
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn cb_frame_out(GstPad *pad, GstPadProbeInfo *info,
+                                      gpointer user_data) {
+    LatencyProbe *probe = (LatencyProbe *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> guard(probe->mutex);
+    auto it = probe->pending.find(pts);
+    if (it != probe->pending.end()) {
+        probe->latencies_ms.push_back(
+            std::chrono::duration<double, std::milli>(now - it->second)
+                .count());
+        probe->pending.erase(it);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static double percentile(std::vector<double> &values, double fraction) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    size_t index = std::min(values.size() - 1,
+                            (size_t)(fraction * (values.size() - 1) + 0.5));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+static std::vector<ThreadingCase> threading_cases() {
+    std::vector<ThreadingCase> cases;
+    cases.push_back({"zerolatency default", {}});
+
+    for (uint threads : {1u, 2u, 4u, 8u, 16u}) {
+        ThreadingCase sliced = {"", {}};
+        sliced.x264.threads = threads;
+        sliced.x264.sliced_threads = true;
+        cases.push_back(sliced);
+    }
+    for (uint threads : {2u, 4u, 8u, 16u}) {
+        ThreadingCase frame = {"", {}};
+        frame.x264.threads = threads;
+        frame.x264.sliced_threads = false;
+        frame.x264.sync_lookahead = 0;
+        cases.push_back(frame);
+    }
+
+    ThreadingCase lookahead = {"frame 8, lookahead 20", {}};
+    lookahead.x264.threads = 8;
+    lookahead.x264.sliced_threads = false;
+    lookahead.x264.rc_lookahead = 20;
+    cases.push_back(lookahead);
+
+    ThreadingCase bframes = {"frame 8, 2 bframes", {}};
+    bframes.x264.threads = 8;
+    bframes.x264.sliced_threads = false;
+    bframes.x264.bframes = 2;
+    cases.push_back(bframes);
+
+    return cases;
+}
+
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+
+    uint width = argc > 1 ? std::atoi(argv[1]) : 1920;
+    uint height = argc > 2 ? std::atoi(argv[2]) : 1080;
+    uint frames = argc > 3 ? std::atoi(argv[3]) : 300;
+    uint bitrate_kbps = argc > 4 ? std::atoi(argv[4]) : 3500;
+
+    if (!is_encoder_available(VideoEncoder::X264)) {
+        fmt::print(stderr, "x264enc is not installed\n");
+        return 1;
+    }
+
+    fmt::print("{}x{}, {} frames at {} fps, target {} kbit/s\n", width, height,
+               frames, FRAME_RATE, bitrate_kbps);
+    fmt::print("{:<24} {:>8} {:>7} {:>9} {:>9} {:>9} {:>9}\n", "settings",
+               "fps", "cores", "kbit/s", "mean ms", "p50 ms", "p99 ms");
+
+    for (ThreadingCase &threading_case : threading_cases()) {
+        EncoderSettings settings;
+        settings.bitrate_kbps = bitrate_kbps;
+        settings.x264 = threading_case.x264;
+
+        std::string label = threading_case.label;
+        if (label.empty()) {
+            label = fmt::format("{} {} threads",
+                                *settings.x264.sliced_threads ? "sliced"
+                                                              : "frame",
+                                *settings.x264.threads);
+        }
+
+        LatencyProbe probe;
+        PassResult result;
+        auto description = fmt::format(
+            "{} ! {} ! fakesink sync=false",
+            source_description(width, height, frames),
+            encoder_description(settings, "encoder"));
+        bool ok = run_pass(description, result, [&probe](GstElement *pipeline) {
+            GstElement *encoder =
+                gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
+            GstPad *sink_pad = gst_element_get_static_pad(encoder, "sink");
+            GstPad *src_pad = gst_element_get_static_pad(encoder, "src");
+            gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, cb_frame_in,
+                              &probe, nullptr);
+            gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, cb_frame_out,
+                              &probe, nullptr);
+            gst_object_unref(sink_pad);
+            gst_object_unref(src_pad);
+            gst_object_unref(encoder);
+        });
+        if (!ok) {
+            fmt::print("{:<24} failed\n", label);
+            continue;
+        }
+
+        std::vector<double> &latencies = probe.latencies_ms;
+        double mean = 0.0;
+        for (double latency : latencies) {
+            mean += latency;
+        }
+        mean = latencies.empty() ? 0.0 : mean / latencies.size();
+        double kbps = result.encoded_bytes * 8.0 / 1000.0 /
+                      ((double)frames / FRAME_RATE);
+
+        fmt::print("{:<24} {:>8.1f} {:>7.2f} {:>9.0f} {:>9.2f} {:>9.2f} "
+                   "{:>9.2f}\n",
+                   label, frames / result.wall_seconds,
+                   result.cpu_seconds / result.wall_seconds, kbps, mean,
+                   percentile(latencies, 0.5), percentile(latencies, 0.99));
+    }
+
+    return 0;
+}
@@ -2,16 +2,52 @@
 ctypedef unsigned int uint
 ctypedef unsigned long int uint64_t
 
+from libc.stdint cimport uint8_t
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+
 
 cdef extern from "rtmp.hpp":
+    cdef struct StreamerMetrics:
+        double last_start_latency_ms
+        double last_stop_latency_ms
+        uint target_bitrate_kbps
+        double encoder_output_kbps
+        double encoder_peak_kbps
+        double rtmp_output_kbps
+        double rtmp_queue_fill
+        uint output_width
+        uint output_height
+        uint adaptive_bitrate_steps_down
+        uint adaptive_bitrate_steps_up
+        double encoder_load
+        uint64_t frames_skipped
+        bint rtmp_reconnecting
+        uint rtmp_reconnect_attempts
+        uint rtmp_reconnects
+        double rtmp_last_downtime_ms
+        uint64_t rtmp_replayed_frames
+
     cdef cppclass RtmpStreamer:
         RtmpStreamer() except +
         RtmpStreamer(uint width, uint height, char *rtmp_streaming_solution) except +
         void start_stream()
         void stop_stream()
+        void pause_stream()
+        void resume_stream()
+        StreamerMetrics get_metrics()
         bint send_frame(unsigned char *frame, uint64_t size)
         void start_rtmp_stream()
         void stop_rtmp_stream()
         void start_local_stream()
         void stop_local_stream()
+        void standby_rtmp_stream()
+        void resume_rtmp_stream()
+        bint request_keyframe()
+        bint set_input_resolution(uint width, uint height, bint keep_output_resolution)
+        bint set_input_frame_rate(int frame_rate)
+        bint set_output_frame_rate(int frame_rate)
+        bint set_bitrate(uint kbps)
+        bint set_overlay_text(const string &text)
+        vector[uint8_t] snapshot()
         void debug_info()
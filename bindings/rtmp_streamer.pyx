@@ -30,6 +30,15 @@ cdef class PyRtmpStreamer:
     def stop_stream(self):
         self.c_obj.stop_stream()
 
+    def pause_stream(self):
+        self.c_obj.pause_stream()
+
+    def resume_stream(self):
+        self.c_obj.resume_stream()
+
+    def get_metrics(self) -> dict:
+        return self.c_obj.get_metrics()
+
     def send_frame(self, frame: bytes) -> bool :
         cdef size_t c_size = self.width * self.height * RGB_BYTECOUNT
         cdef unsigned char * c_frame = <unsigned char *> frame
@@ -47,5 +56,37 @@ cdef class PyRtmpStreamer:
     def stop_local_stream(self):
         self.c_obj.stop_local_stream()
 
+    def standby_rtmp_stream(self):
+        self.c_obj.standby_rtmp_stream()
+
+    def resume_rtmp_stream(self):
+        self.c_obj.resume_rtmp_stream()
+
+    def request_keyframe(self) -> bool:
+        return self.c_obj.request_keyframe()
+
+    def set_input_resolution(self, width: int, height: int, keep_output_resolution: bool = False) -> bool:
+        if not self.c_obj.set_input_resolution(width, height, keep_output_resolution):
+            return False
+        self.width = width
+        self.height = height
+        return True
+
+    def set_input_frame_rate(self, frame_rate: int) -> bool:
+        return self.c_obj.set_input_frame_rate(frame_rate)
+
+    def set_output_frame_rate(self, frame_rate: int) -> bool:
+        return self.c_obj.set_output_frame_rate(frame_rate)
+
+    def set_bitrate(self, kbps: int) -> bool:
+        return self.c_obj.set_bitrate(kbps)
+
+    def set_overlay_text(self, text: str) -> bool:
+        return self.c_obj.set_overlay_text(bytes(text, "utf-8"))
+
+    def snapshot(self) -> bytes:
+        data = self.c_obj.snapshot()
+        return bytes(data)
+
     def debug_info(self):
         self.c_obj.debug_info()
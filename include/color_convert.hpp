@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief Order of the channels of a packed 24-bit pixel.
+ */
+enum class ChannelOrder {
+    RGB,  ///< Red in the first byte, as sent through the raw frame API.
+    BGR,  ///< Blue in the first byte, the native order of OpenCV.
+};
+
+/**
+ * @brief The instruction sets a conversion kernel can be built for.
+ */
+enum class SimdLevel {
+    Scalar,  ///< Plain C++, available everywhere.
+    Sse41,   ///< 128-bit vectors, requires SSE4.1.
+    Avx2,    ///< 256-bit vectors, requires AVX2.
+};
+
+/**
+ * @brief Converts packed 24-bit RGB or BGR into planar I420.
+ *
+ * Uses BT.709 coefficients in limited range, the colorimetry GStreamer
+ * assumes for I420 above SD resolution. Chroma is the average of each 2x2
+ * block. Odd widths and heights are handled, the last chroma column or row
+ * is then taken from a single pixel column or row.
+ *
+ * @param src The first pixel of the packed frame.
+ * @param src_stride Bytes between the starts of two rows of `src`.
+ * @param order The order of the channels in `src`.
+ * @param width The pixel width of the frame.
+ * @param height The pixel height of the frame.
+ * @param dst_y The luma plane, `width` x `height`.
+ * @param y_stride Bytes between two rows of `dst_y`.
+ * @param dst_u The Cb plane, half the width and height rounded up.
+ * @param u_stride Bytes between two rows of `dst_u`.
+ * @param dst_v The Cr plane, half the width and height rounded up.
+ * @param v_stride Bytes between two rows of `dst_v`.
+ */
+using RgbToI420Kernel = void (*)(const uint8_t *src, int src_stride,
+                                 ChannelOrder order, int width, int height,
+                                 uint8_t *dst_y, int y_stride, uint8_t *dst_u,
+                                 int u_stride, uint8_t *dst_v, int v_stride);
+
+/**
+ * @brief Returns the most capable instruction set of the running CPU.
+ *
+ * @return The best SimdLevel the kernels can use.
+ */
+SimdLevel best_simd_level();
+
+/**
+ * @brief Returns a printable name of an instruction set.
+ *
+ * @param level The instruction set to name.
+ * @return The name of the instruction set.
+ */
+const char *simd_level_name(SimdLevel level);
+
+/**
+ * @brief Returns the RGB to I420 kernel built for an instruction set.
+ *
+ * @param level The instruction set.
+ * @return The kernel, or nullptr if the running CPU does not support it.
+ */
+RgbToI420Kernel get_rgb_to_i420_kernel(SimdLevel level);
+
+/**
+ * @brief Converts packed 24-bit RGB or BGR into planar I420 with the
+ * fastest kernel of the running CPU. See RgbToI420Kernel for the
+ * parameters.
+ */
+void rgb_to_i420(const uint8_t *src, int src_stride, ChannelOrder order,
+                 int width, int height, uint8_t *dst_y, int y_stride,
+                 uint8_t *dst_u, int u_stride, uint8_t *dst_v, int v_stride);
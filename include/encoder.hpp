@@ -0,0 +1,286 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/**
+ * @brief The video encoders the streamer can be built with.
+ */
+enum class VideoEncoder {
+    X264,       ///< H.264 through x264enc.
+    X265,       ///< H.265 through x265enc.
+    OpenH264,   ///< H.264 through openh264enc.
+    VP8,        ///< VP8 through vp8enc.
+    VP9,        ///< VP9 through vp9enc.
+    SvtAv1,     ///< AV1 through svtav1enc.
+    Rav1e,      ///< AV1 through rav1enc.
+    VaapiH264,  ///< H.264 through vaapih264enc, on a VA-API capable GPU.
+};
+
+/**
+ * @brief Static description of how an encoder is used in the pipeline.
+ */
+struct EncoderProfile {
+    /**
+     * @brief Name of the GStreamer element factory of the encoder.
+     */
+    const char *factory;
+
+    /**
+     * @brief Name of the parser producing a self-contained elementary
+     * stream, or nullptr if the encoder output needs no parsing.
+     */
+    const char *parser;
+
+    /**
+     * @brief Extra properties set on the parser.
+     */
+    const char *parser_options;
+
+    /**
+     * @brief Caps of the elementary stream delivered after the parser.
+     */
+    const char *stream_caps;
+
+    /**
+     * @brief Name of the encoder property holding the target bitrate.
+     */
+    const char *bitrate_property;
+
+    /**
+     * @brief Factor converting kbit/s into the unit of `bitrate_property`.
+     */
+    uint bitrate_multiplier;
+
+    /**
+     * @brief Name of the encoder property holding the maximal distance
+     * between two keyframes in frames.
+     */
+    const char *keyframe_interval_property;
+
+    /**
+     * @brief True if the encoded stream can be muxed into FLV for RTMP.
+     */
+    bool flv_compatible;
+
+    /**
+     * @brief True if the encoder reads the quantizer offsets of the
+     * GstVideoRegionOfInterestMeta attached to its input frames.
+     */
+    bool region_of_interest;
+};
+
+/**
+ * @brief Threading and lookahead controls of x264enc.
+ *
+ * Unset values keep the x264enc default, which for `tune=zerolatency` means
+ * sliced threads, no lookahead and no B-frames.
+ */
+struct X264Settings {
+    /**
+     * @brief Number of encoder threads, 0 lets x264 choose.
+     */
+    std::optional<uint> threads;
+
+    /**
+     * @brief Split each frame into slices encoded in parallel instead of
+     * encoding several frames in parallel. Lower latency, lower efficiency.
+     */
+    std::optional<bool> sliced_threads;
+
+    /**
+     * @brief Number of frames used for rate control lookahead.
+     */
+    std::optional<int> rc_lookahead;
+
+    /**
+     * @brief Number of buffer frames for threaded lookahead, -1 for auto.
+     */
+    std::optional<int> sync_lookahead;
+
+    /**
+     * @brief Maximal distance between two keyframes in frames, 0 for auto.
+     */
+    std::optional<uint> key_int_max;
+
+    /**
+     * @brief Number of B-frames between I- and P-frames.
+     */
+    std::optional<uint> bframes;
+
+    /**
+     * @brief Size of the VBV buffer in milliseconds.
+     */
+    std::optional<uint> vbv_buf_capacity;
+};
+
+/**
+ * @brief Keyframe placement of the encoded stream.
+ *
+ * A predictable keyframe interval lets media servers cut segments on every
+ * keyframe and bounds the time a new viewer waits for the first picture.
+ * With neither interval set, the encoder default is kept.
+ */
+struct GopSettings {
+    /**
+     * @brief Keyframe interval in frames, 0 to use `interval_ms`.
+     */
+    uint interval_frames = 0;
+
+    /**
+     * @brief Keyframe interval in milliseconds, only used when
+     * `interval_frames` is 0.
+     */
+    uint interval_ms = 0;
+
+    /**
+     * @brief Prevent frames from referencing frames of the previous GOP, so
+     * every GOP can be decoded on its own. Only matters with B-frames.
+     */
+    bool closed = true;
+
+    /**
+     * @brief Force keyframes on multiples of the interval on the system wall
+     * clock, so streams of several instances with synchronised clocks have
+     * their keyframes at the same instants.
+     */
+    bool align_to_wall_clock = false;
+};
+
+/**
+ * @brief Rate control of the encoded stream.
+ *
+ * By default x264enc already runs in CBR mode with its VBV rate at the
+ * bitrate, but its 600 ms buffer lets single frames burst well above the link
+ * rate, and the other encoders may overshoot the bitrate on scene changes.
+ * Strict CBR bounds the bitrate over every window of a small VBV buffer, so a
+ * link of fixed capacity never falls behind.
+ */
+struct RateControlSettings {
+    /**
+     * @brief Enforce a constant bitrate through the VBV model.
+     */
+    bool strict_cbr = false;
+
+    /**
+     * @brief Size of the VBV buffer in milliseconds, 0 for the encoder
+     * default, or 250 ms for x264 in strict mode. Smaller buffers follow the
+     * link more closely at the cost of quality.
+     */
+    uint vbv_buffer_ms = 0;
+
+    /**
+     * @brief Peak bitrate in kbit/s, 0 to use the target bitrate. A value
+     * set here is not changed by `set_bitrate`.
+     */
+    uint max_bitrate_kbps = 0;
+
+    /**
+     * @brief Pad the stream with filler data up to the target bitrate, so
+     * the link carries a truly constant rate. Only supported by x264, which
+     * pads in strict mode anyway unless `max_bitrate_kbps` differs from the
+     * target.
+     */
+    bool filler = false;
+};
+
+/**
+ * @brief Settings of the encoder in the RTMP bin.
+ */
+struct EncoderSettings {
+    /**
+     * @brief The encoder used for the stream.
+     */
+    VideoEncoder backend = VideoEncoder::X264;
+
+    /**
+     * @brief Target bitrate in kbit/s.
+     */
+    uint bitrate_kbps = 3500;
+
+    /**
+     * @brief Speed preset, only used by x264 and x265.
+     */
+    std::string speed_preset = "ultrafast";
+
+    /**
+     * @brief Tune the encoder for real-time delivery without frame
+     * reordering or lookahead. Disable it for recordings, where compression
+     * matters more than delay. Only used by x264, x265 and rav1e.
+     */
+    bool low_latency = true;
+
+    /**
+     * @brief Controls only applied when `backend` is VideoEncoder::X264.
+     */
+    X264Settings x264;
+
+    /**
+     * @brief Keyframe placement, overrides `x264.key_int_max` when set.
+     */
+    GopSettings gop;
+
+    /**
+     * @brief Rate control, overrides `x264.vbv_buf_capacity` when set.
+     */
+    RateControlSettings rate_control;
+};
+
+/**
+ * @brief Returns the profile of an encoder.
+ *
+ * @param encoder The encoder to look up.
+ * @return The static profile of the encoder.
+ */
+const EncoderProfile &get_encoder_profile(VideoEncoder encoder);
+
+/**
+ * @brief Returns a printable name of an encoder.
+ *
+ * @param encoder The encoder to name.
+ * @return The element factory name of the encoder.
+ */
+const char *encoder_name(VideoEncoder encoder);
+
+/**
+ * @brief Checks whether the plugins an encoder needs are installed.
+ *
+ * NOTE: gst_init must have been called before.
+ *
+ * @param encoder The encoder to check.
+ * @return True if both the encoder and its parser are available.
+ */
+bool is_encoder_available(VideoEncoder encoder);
+
+/**
+ * @brief Returns the keyframe interval of a GOP policy in frames.
+ *
+ * @param gop The GOP policy.
+ * @param frame_rate The frame rate of the encoded stream.
+ * @return The interval in frames, or 0 if the encoder default is kept.
+ */
+uint gop_interval_frames(const GopSettings &gop, int frame_rate);
+
+/**
+ * @brief Returns the keyframe interval of a GOP policy in milliseconds.
+ *
+ * @param gop The GOP policy.
+ * @param frame_rate The frame rate of the encoded stream.
+ * @return The interval in milliseconds, or 0 if the encoder default is kept.
+ */
+uint gop_interval_ms(const GopSettings &gop, int frame_rate);
+
+/**
+ * @brief Builds the gst-launch description of a low latency encoder.
+ *
+ * @param settings The encoder settings.
+ * @param name The name to give the encoder element.
+ * @param frame_rate The frame rate of the encoded stream, used to convert a
+ * GOP interval given in milliseconds.
+ * @return The description of the encoder element and its properties.
+ */
+std::string encoder_description(const EncoderSettings &settings,
+                                const char *name, int frame_rate = 30);
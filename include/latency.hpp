@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Wall-clock times of one frame on its way through the streamer,
+ * embedded into the encoded stream when `StreamerConfig::embed_timestamps`
+ * is set.
+ *
+ * All times are microseconds since the Unix epoch, so a receiver on another
+ * machine can compare them with its own clock as far as the clocks are
+ * synchronized.
+ */
+struct FrameTimestamps {
+    /**
+     * @brief Sequence number of the frame in `send_frame`, starting at 0.
+     * Gaps show frames dropped before they reached the server.
+     */
+    uint64_t frame_id = 0;
+
+    /**
+     * @brief When `send_frame` was called with the frame.
+     */
+    int64_t ingest_us = 0;
+
+    /**
+     * @brief When the frame entered the encoder.
+     */
+    int64_t encoder_input_us = 0;
+
+    /**
+     * @brief When the encoded frame left the encoder.
+     */
+    int64_t encoder_output_us = 0;
+};
+
+/**
+ * @brief Returns the clock the timestamps are taken from.
+ *
+ * @return Microseconds since the Unix epoch.
+ */
+int64_t wall_clock_us();
+
+/**
+ * @brief Builds the H.264 SEI NAL unit carrying the timestamps of a frame,
+ * a user_data_unregistered message with emulation prevention applied.
+ *
+ * @param timestamps The timestamps to embed.
+ * @return The NAL unit, starting with its header and without a start code
+ * or length prefix.
+ */
+std::vector<uint8_t> build_timestamp_sei(const FrameTimestamps &timestamps);
+
+/**
+ * @brief Looks for the timestamp SEI in an encoded H.264 access unit.
+ *
+ * @param data The access unit.
+ * @param size Size of `data` in bytes.
+ * @param nal_length_size Size of the NAL unit length prefixes, 4 for the
+ * payload of FLV video tags, or 0 for an Annex B byte-stream.
+ * @param timestamps Where to store the timestamps.
+ * @return True if the access unit carried the timestamps; false otherwise.
+ */
+bool find_timestamp_sei(const uint8_t *data, size_t size,
+                        size_t nal_length_size,
+                        FrameTimestamps &timestamps);
+
+/**
+ * @brief Percentiles of one stage of the latency, in milliseconds.
+ */
+struct LatencyPercentiles {
+    double p50_ms = 0.0;
+    double p99_ms = 0.0;
+    double p999_ms = 0.0;
+    double max_ms = 0.0;
+};
+
+/**
+ * @brief Latency of the frames seen by a receiver, split into the stages
+ * of the streamer.
+ */
+struct LatencyReport {
+    /**
+     * @brief Number of frames measured.
+     */
+    size_t frames = 0;
+
+    /**
+     * @brief Number of frame IDs missing between the measured frames.
+     */
+    uint64_t missing_frames = 0;
+
+    /**
+     * @brief From `send_frame` to the encoder input: conversion, scaling,
+     * frame rate conversion and queueing.
+     */
+    LatencyPercentiles pre_encode;
+
+    /**
+     * @brief Time spent inside the encoder.
+     */
+    LatencyPercentiles encode;
+
+    /**
+     * @brief From the encoder output to the receiver: muxing, the RTMP
+     * queue, rtmp2sink and the network.
+     */
+    LatencyPercentiles delivery;
+
+    /**
+     * @brief From `send_frame` to the receiver.
+     */
+    LatencyPercentiles end_to_end;
+};
+
+/**
+ * @brief Receiver-side collection of the embedded timestamps.
+ */
+class LatencyRecorder {
+   public:
+    /**
+     * @brief Records a received frame.
+     *
+     * @param timestamps The timestamps embedded into the frame.
+     * @param arrival_us When the frame was received, from `wall_clock_us`.
+     */
+    void add(const FrameTimestamps &timestamps, int64_t arrival_us);
+
+    /**
+     * @brief Looks for the timestamps in an access unit and records the
+     * frame if it carries them.
+     *
+     * @return True if the frame was recorded; false otherwise.
+     */
+    bool add(const uint8_t *data, size_t size, size_t nal_length_size,
+             int64_t arrival_us);
+
+    /**
+     * @brief Computes the percentiles of every stage over the recorded
+     * frames.
+     */
+    LatencyReport report() const;
+
+    /**
+     * @brief Forgets the recorded frames.
+     */
+    void clear();
+
+   private:
+    std::vector<FrameTimestamps> frames;
+    std::vector<int64_t> arrivals_us;
+};
@@ -1,354 +1,1901 @@
+#include <gst/app/gstappsink.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/gst.h>
+#include <gst/video/video.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/opencv.hpp>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
-class RtmpStreamer {
-   public:
+#include "color_convert.hpp"
+#include "encoder.hpp"
+#include "latency.hpp"
 
+/**
+ * @brief Runtime measurements of the streaming pipeline.
+ */
+struct StreamerMetrics {
     /**
-     * @brief Default constructor for the RtmpStreamer class.
-     *
-     * The `RtmpStreamer` constructor initializes the streamer with a default
-     * video input resolution of 1024x1024. Default RTMP server is
-     * 'rtmp://ome.waraps.org/app/name-your-stream'. 
+     * @brief Milliseconds the last start or resume took to reach PLAYING.
      */
-    RtmpStreamer();
+    double last_start_latency_ms = 0.0;
 
     /**
-     * @brief Constructs an RtmpStreamer with specified width and height.
-     *
-     * @param width The pixel width of each input frame.
-     * @param height The pixel height of each input frame.
-     * @param rtmp_streaming_addr The address of the RTMP server to stream to.
-     *
-     * NOTE: The last part of the streaming address becomes the name of stream
-     *
+     * @brief Milliseconds the last stop or pause took to reach its target
+     * state.
      */
-    RtmpStreamer(uint width, uint height, const char *rtmp_streaming_addr);
+    double last_stop_latency_ms = 0.0;
 
     /**
-     * @brief Deleted copy constructor to prevent copying of RtmpStreamer
-     * instances.
+     * @brief The bitrate the encoder is currently targeting in kbit/s.
      */
-    RtmpStreamer(const RtmpStreamer &) = delete;
+    uint target_bitrate_kbps = 0;
 
     /**
-     * @brief Deleted copy assignment operator to prevent copying of
-     * RtmpStreamer instances.
+     * @brief Bitrate leaving the encoder over the last monitor interval in
+     * kbit/s.
      */
-    RtmpStreamer &operator=(const RtmpStreamer &) = delete;
+    double encoder_output_kbps = 0.0;
 
     /**
-     * @brief Destructor for the RtmpStreamer class.
-     *
-     * Cleans up and releases resources held by the RtmpStreamer instance.
+     * @brief Highest bitrate leaving the encoder over any one second window
+     * of stream time that ended during the last monitor interval, in kbit/s.
+     * Compared with `target_bitrate_kbps`, it shows how far the rate control
+     * overshoots the link.
      */
-    ~RtmpStreamer();
+    double encoder_peak_kbps = 0.0;
 
     /**
-     * @brief Sends a video frame to the GStreamer pipeline for streaming.
-     *
-     * The cv::Mat frame must be in the format of either RGBA or ARGB.
-     *
-     * @param frame The video frame to be sent, represented as an OpenCV Mat
-     * object.
-     * @return True if the frame was successfully sent; false otherwise.
+     * @brief Bitrate written to the RTMP server over the last monitor
+     * interval in kbit/s.
      */
-    bool send_frame(cv::Mat &frame);
+    double rtmp_output_kbps = 0.0;
 
     /**
-     * @brief Sends a video frame to the GStreamer pipeline for streaming.
-     *
-     * The Frame must be in the format of RGB.
-     *
-     * @param frame Pointer to the raw video frame data.
-     * @param size The size of the video frame data in bytes.
-     * @return True if the frame was successfully sent; false otherwise.
+     * @brief Fill level of the RTMP queue, from 0 (empty) to 1 (full).
      */
-    bool send_frame(unsigned char *frame, size_t size);
+    double rtmp_queue_fill = 0.0;
 
     /**
-     * @brief Starts the whole streaming pipeline.
-     *
-     * Will start both the local stream and the stream to the RTMP server.
+     * @brief Pixel width of the stream sent to the RTMP server.
      */
-    void start_stream();
+    uint output_width = 0;
 
     /**
-     * @brief Stops the whole streaming pipeline.
-     *
-     * Will stop both the local stream and the stream to the RTMP server.
+     * @brief Pixel height of the stream sent to the RTMP server.
      */
-    void stop_stream();
+    uint output_height = 0;
 
     /**
-     * @brief Starts the stream to the RTMP server.
+     * @brief Number of times the adaptive bitrate controller lowered the
+     * bitrate.
      */
-    void start_rtmp_stream();
+    uint adaptive_bitrate_steps_down = 0;
 
     /**
-     * @brief Stops the stream to the RTMP server.
+     * @brief Number of times the adaptive bitrate controller raised the
+     * bitrate.
      */
-    void stop_rtmp_stream();
+    uint adaptive_bitrate_steps_up = 0;
 
     /**
-     * @brief Starts the local video stream.
+     * @brief Mean time the encoder spent on a frame over the last monitor
+     * interval, relative to the time between two encoded frames. Above 1 the
+     * encoder falls behind the input.
      */
-    void start_local_stream();
+    double encoder_load = 0.0;
 
     /**
-     * @brief Stops the local video stream.
+     * @brief Number of frames the CPU QoS controller kept from the encoder.
      */
-    void stop_local_stream();
+    uint64_t frames_skipped = 0;
 
     /**
-     * @brief Provides a command-line interface for controlling the RTMP and
-     * local streams.
-     *
-     * The `async_streamer_control_unit` function continuously reads commands
-     * from the standard input and executes the corresponding streamer control
-     * functions based on the input.
-     *
-     * Supported commands:
-     * - `stop_stream`        : Stops the whole stream.
-     * - `start_stream`       : Stops the whole stream.
-     * - `stop_rtmp_stream`   : Stops the RTMP stream.
-     * - `stop_local_stream`  : Stops the local stream.
-     * - `start_rtmp_stream`  : Starts the RTMP stream.
-     * - `start_local_stream` : Starts the local stream.
-     * - `quit`               : Exits the command loop.
-     *
-     * If an invalid command is entered, an error message is printed to the
-     * standard error. The command loop will continue to process commands until
-     * the "quit" command is received.
+     * @brief Flag indicating whether the RTMP connection is lost and being
+     * reestablished.
      */
-    void async_streamer_control_unit();
+    bool rtmp_reconnecting = false;
 
     /**
-     * @brief Provides information about all elements connected to the pipeline.
-     *
-     * A debuging tool to display information about the pipeline such as,
-     * available elements, available pads, ghost pads and their linking state.
-     * It also gives information abot the current state of the element.
+     * @brief Number of attempts made to reconnect to the RTMP server.
      */
-    void debug_info();
+    uint rtmp_reconnect_attempts = 0;
 
-   private:
     /**
-     * @brief Callback function that sets the flag indicating that data is
-     * needed.
-     *
-     * The `cb_need_data` function is a static callback used by the GStreamer
-     * `appsrc` element. It is called by the appsrc element when it needs more
-     * data.
-     *
-     * @param appsrc The GStreamer appsrc element requesting data.
-     * @param size The size of the data needed.
-     * @param user_data A pointer to user data; in this case, a boolean flag
-     * indicating the need for data.
+     * @brief Number of times the connection to the RTMP server was
+     * reestablished.
      */
-    static void cb_need_data(GstAppSrc *appsrc, guint size, gpointer user_data);
+    uint rtmp_reconnects = 0;
 
     /**
-     * @brief Callback function that resets the flag indicating that no more
-     * data is needed.
-     *
-     * The `cb_enough_data` function is a static callback used by the GStreamer
-     * `appsrc` element. It is called by appsrc when it has enough data.
-     *
-     * @param appsrc The GStreamer appsrc element indicating no more data is
-     * needed.
-     * @param user_data A pointer to user data; in this case, a boolean flag
-     * indicating the need for data.
+     * @brief Milliseconds from losing the RTMP connection until the last
+     * successful reconnect.
      */
-    static void cb_enough_data(GstAppSrc *appsrc, gpointer user_data);
+    double rtmp_last_downtime_ms = 0.0;
 
     /**
-     * @brief Connects a sink bin to a source bin in a GStreamer pipeline.
-     *
-     * This function adds a sink bin to the pipeline and links it to a
-     * source bin using a tee element. Does not change pipeline state but sets
-     * sink element to GST_PLAYING
-     *
-     * NOTE: Source element must contain a tee element.
-     *
-     * @param source_bin The source bin element to connect from.
-     * @param sink_bin The sink bin element to connect to. 
-     * NOTE: Transfers ownership of sink_bin to the pipeline
-     *
-     * @param request_pad A place to store the requested pad from the tee
-     * element.
-     * @param tee_element_name The name of the tee element within the source
-     * bin.
-     * @param tee_ghost_pad_name The name of the ghost pad to create in the
-     * source bin.
-     * @return true if the connection was successful, false otherwise.
+     * @brief Number of buffered frames sent again after reconnects.
      */
-    bool connect_sink_bin_to_source_bin(GstElement *source_bin,
-                                        GstElement **sink_bin,
-                                        GstPad **request_pad,
-                                        const char *tee_element_name,
-                                        const char *tee_ghost_pad_name);
+    uint64_t rtmp_replayed_frames = 0;
+};
 
+/**
+ * @brief Settings of the adaptive bitrate controller.
+ *
+ * The controller lowers the bitrate as soon as the uplink falls behind and
+ * only raises it again after it has stayed healthy for a while, so it does
+ * not oscillate around the capacity of the link.
+ */
+struct AdaptiveBitrateConfig {
     /**
-     * @brief Disconnects a sink bin from a source bin in the GStreamer
-     * pipeline.
-     *
-     * @param source_bin The source bin from which to disconnect.
-     * @param sink_bin Location to store the removed sink-bin
-     * @param request_pad The pad from the tee element to be disconnected.
-     * @param sink_bin_name The name of the sink bin to remove
-     * @param tee_ghost_pad_name The name of the ghost pad in the source
-     * bin.
-     * @return True if the disconnection is successful, otherwise false.
-     *
-     * @side-effect Transfers ownership of removed sink-bin to 
+     * @brief The lowest bitrate the controller steps down to in kbit/s.
      */
-    bool disconnect_sink_bin_from_source_bin(GstElement *source_bin,
-                                             GstElement **sink_bin,
-                                             GstPad *request_pad,
-                                             const char *sink_bin_name,
-                                             const char *tee_ghost_pad_name);
+    uint min_bitrate_kbps = 500;
 
     /**
-     * @brief Sends a frame to the appsrc element.
-     *
-     * @param data Pointer to the frame data. Must be in RGB format.
-     * @param size Size of the frame data in bytes.
-     * @return True if the frame is successfully sent, otherwise false.
+     * @brief The highest bitrate the controller steps up to in kbit/s, 0
+     * uses the bitrate of the encoder settings.
      */
-    bool send_frame_to_appsrc(void *data, size_t size);
+    uint max_bitrate_kbps = 0;
 
     /**
-     * @brief Connects the signal handlers for appsrc's need-data and
-     * enough-data signals.
-     *
-     * @return True if the signal handlers are successfully connected, false
-     * otherwise.
+     * @brief Factor applied to the bitrate when the uplink is congested.
      */
-    bool connect_appsrc_signal_handler();
+    double step_down_factor = 0.7;
 
     /**
-     * @brief Disconnects the signal handlers for appsrc's need-data and
-     * enough-data signals.
-     *
-     * @return True if the signal handlers are successfully disconnected, false
-     * otherwise.
+     * @brief Factor applied to the bitrate when the uplink is healthy.
      */
-    bool disconnect_appsrc_signal_handler();
+    double step_up_factor = 1.15;
 
     /**
-     * @brief Checks for errors in the streaming process.
-     *
-     * NOTE: Should be run async with the program.
+     * @brief RTMP queue fill level above which the uplink is congested.
+     */
+    double high_watermark = 0.3;
+
+    /**
+     * @brief RTMP queue fill level below which the uplink is healthy.
+     */
+    double low_watermark = 0.05;
+
+    /**
+     * @brief How often the controller makes a decision in milliseconds.
+     */
+    uint interval_ms = 1000;
+
+    /**
+     * @brief Number of consecutive healthy intervals before stepping up.
+     */
+    uint step_up_hold_intervals = 5;
+
+    /**
+     * @brief Also lower the resolution sent to the RTMP server when the
+     * bitrate falls below half and a quarter of the maximal bitrate.
+     */
+    bool allow_resolution_change = true;
+};
+
+/**
+ * @brief Settings of the automatic reconnection to the RTMP server.
+ *
+ * When the connection is lost, only the muxer and rtmp2sink are restarted.
+ * The encoder and the other branches keep running, and the encoded frames
+ * meant for the server are dropped until the connection is back. The delay
+ * before each attempt grows exponentially and is randomized, so many
+ * streamers losing the same server do not reconnect in lockstep.
+ */
+struct ReconnectConfig {
+    /**
+     * @brief Reconnect automatically. When false, errors of the RTMP sink
+     * reach the bus and `check_error` as before. Errors before the sink
+     * first wrote to the server, such as a wrong address or a server that is
+     * down at startup, always reach the bus.
+     */
+    bool enabled = true;
+
+    /**
+     * @brief Delay before the first attempt in milliseconds.
+     */
+    uint initial_delay_ms = 500;
+
+    /**
+     * @brief Upper bound of the delay between two attempts in milliseconds.
+     */
+    uint max_delay_ms = 30000;
+
+    /**
+     * @brief Factor applied to the delay after every failed attempt.
+     */
+    double backoff_factor = 2.0;
+
+    /**
+     * @brief Fraction of the delay it is randomly shortened or lengthened
+     * by, from 0 (exact) to 1.
+     */
+    double jitter = 0.25;
+
+    /**
+     * @brief Attempts per outage before the error is posted to the bus, 0
+     * retries forever.
+     */
+    uint max_attempts = 0;
+
+    /**
+     * @brief Memory cap of the replay buffer in bytes, 0 disables it.
      *
-     * @return True if there is an error, otherwise false.
+     * The buffer holds the encoded frames of the current GOP. After a
+     * reconnect they are sent again from the keyframe, faster than real
+     * time, so the server gets no gap and no forced keyframe is needed. A
+     * GOP larger than the cap is not buffered, and the stream resumes at the
+     * next keyframe instead. Until the replay has drained, the RTMP queue is
+     * bounded by this many bytes on top of its usual size instead of its
+     * usual buffer and time limits, so it never blocks the encoder.
      */
-    [[nodiscard, maybe_unused]] bool check_error() const;
-    gboolean check_links();
-    void initialize_streamer();
+    size_t replay_buffer_bytes = 8 * 1024 * 1024;
+};
 
+/**
+ * @brief Settings of the CPU QoS controller.
+ *
+ * The controller compares the time the encoder spends on a frame with the
+ * time between two frames. It first switches to a faster speed preset, if
+ * the encoder allows it while playing, and then skips frames at the encoder
+ * input, before frames pile up in front of the encoder and `send_frame`
+ * starts failing.
+ */
+struct CpuQosConfig {
     /**
-     * @brief Mutex for synchronizing access to the want_data flag.
+     * @brief Encoder load above which the encoder is overloaded.
      */
-    static std::mutex want_data_muxex;
+    double high_load = 0.85;
 
     /**
-     * @brief Mutex for synchronizing access to the pipeline handling process.
+     * @brief Encoder load below which the encoder has headroom.
      */
-    static std::mutex handling_pipeline;
+    double low_load = 0.5;
 
     /**
-     * @brief The width of the screen or video frame.
+     * @brief Largest number of input frames per encoded frame; 2 encodes
+     * every other frame.
      */
-    uint screen_width;
+    uint max_frame_divisor = 3;
 
     /**
-     * @brief The height of the screen or video frame.
+     * @brief How often the controller makes a decision in milliseconds.
      */
-    uint screen_height;
+    uint interval_ms = 1000;
 
     /**
-     * @brief Flag indicating whether data is needed by appsrc.
+     * @brief Number of consecutive intervals with headroom before undoing a
+     * step.
      */
-    bool want_data;
+    uint recover_hold_intervals = 5;
+};
+
+/**
+ * @brief A step taken by the CPU QoS controller.
+ */
+enum class CpuQosAction {
+    FasterPreset,     ///< Switched to a faster speed preset.
+    SlowerPreset,     ///< Switched back to a slower speed preset.
+    SkipMoreFrames,   ///< Increased the frame divisor.
+    SkipFewerFrames,  ///< Decreased the frame divisor.
+};
 
+/**
+ * @brief Describes one decision of the CPU QoS controller.
+ */
+struct CpuQosEvent {
     /**
-     * @brief The number of bins currently connected to the source bin.
+     * @brief The step that was taken.
      */
-    int connected_bins_to_source;
+    CpuQosAction action;
 
     /**
-     * @brief The GStreamer pipeline element.
+     * @brief The encoder load that caused the step.
      */
-    GstElement *pipeline;
+    double encoder_load;
 
     /**
-     * @brief The source bin element in the GStreamer pipeline.
+     * @brief The speed preset after the step.
      */
-    GstElement *source_bin;
+    std::string speed_preset;
 
     /**
-     * @brief The RTMP bin element in the GStreamer pipeline.
+     * @brief The number of input frames per encoded frame after the step.
      */
-    GstElement *rtmp_bin;
+    uint frame_divisor;
+};
 
+/**
+ * @brief Callback receiving every decision of the CPU QoS controller.
+ *
+ * Runs on the monitor thread, which is blocked until it returns. It must not
+ * call `set_bitrate` or change the controllers, which wait for that thread.
+ */
+using CpuQosEventCallback = std::function<void(const CpuQosEvent &)>;
+
+/**
+ * @brief An encoded access unit taken from the output of the encoder.
+ *
+ * The data points straight into the memory of `buffer` and is only valid for
+ * the duration of the callback. Take a reference with `gst_buffer_ref` to
+ * keep it longer.
+ */
+struct EncodedPacket {
     /**
-     * @brief The local video bin element in the GStreamer pipeline.
+     * @brief The buffer holding the access unit.
      */
-    GstElement *local_video_bin;
+    GstBuffer *buffer;
 
     /**
-     * @brief The name of the source bin element.
+     * @brief The access unit, in Annex B byte-stream format for H.264 and
+     * H.265.
      */
-    gchar *source_bin_name;
+    const uint8_t *data;
 
     /**
-     * @brief The name of the RTMP bin element.
+     * @brief Size of the access unit in bytes.
      */
-    gchar *rtmp_bin_name;
+    size_t size;
 
     /**
-     * @brief The name of the local video bin element.
+     * @brief Presentation timestamp in nanoseconds.
      */
-    gchar *local_video_bin_name;
+    GstClockTime pts;
 
     /**
-     * @brief The appsrc element for pushing frames into the GStreamer pipeline.
+     * @brief Decoding timestamp in nanoseconds.
      */
-    GstElement *appsrc;
+    GstClockTime dts;
 
     /**
-     * @brief The pad of the RTMP tee element.
+     * @brief True if the access unit can be decoded on its own.
      */
-    GstPad *src_rtmp_tee_pad;
+    bool keyframe;
+};
 
+/**
+ * @brief A region of a frame to encode at a different quality than the rest.
+ *
+ * Attached to the frame as a GstVideoRegionOfInterestMeta, which is scaled
+ * along with the frame. Only encoders whose profile has
+ * `region_of_interest` set read it, currently VideoEncoder::VaapiH264;
+ * `send_frame` refuses regions for the other encoders.
+ */
+struct RegionOfInterest {
     /**
-     * @brief The pad of the local video tee element.
+     * @brief The region in pixel coordinates of the frame passed to
+     * `send_frame`.
      */
-    GstPad *src_local_tee_pad;
+    cv::Rect rect;
 
     /**
-     * @brief ID for the need-data signal handler for appsrc.
+     * @brief Quantizer offset of the region, negative values spend more bits
+     * on it and positive values fewer.
      */
-    gint appsrc_need_data_id;
+    int delta_qp = -10;
+};
+
+/**
+ * @brief Callback receiving every encoded access unit.
+ */
+using EncodedPacketCallback = std::function<void(const EncodedPacket &)>;
+
+/**
+ * @brief Callback receiving raw frames from the analytics stream.
+ *
+ * The frame is a BGR view straight into the mapped GstBuffer and is only
+ * valid for the duration of the callback; clone it to keep it longer. The
+ * second argument is the presentation timestamp in nanoseconds.
+ */
+using RawFrameCallback =
+    std::function<void(const cv::Mat &frame, GstClockTime pts)>;
+
+/**
+ * @brief The sink used by the local video stream.
+ */
+enum class PreviewSink {
+    Window,        ///< Renders to a window through autovideosink.
+    Fake,          ///< Discards every frame; useful on headless servers.
+    App,           ///< Keeps the latest frame for `pull_preview_frame`.
+    SharedMemory,  ///< Publishes frames through shmsink for external viewers.
+};
 
+/**
+ * @brief Settings of the archival recording.
+ *
+ * The defaults favour quality over speed, the archive branch runs behind a
+ * large leaky queue at lower thread priority, so it drops frames rather than
+ * delaying the live stream when the CPU runs short.
+ */
+struct ArchiveConfig {
     /**
-     * @brief ID for the enough-data signal handler appsrc.
+     * @brief Path of the Matroska file the recording is written to.
      */
-    gint appsrc_enough_data_id;
+    std::string location = "archive.mkv";
 
     /**
-     * @brief The GStreamer bus element for handling messages from the pipeline.
+     * @brief Settings of the archive encoder.
      */
-    GstBus *bus;
+    EncoderSettings encoder = {VideoEncoder::X264, 12000, "slow", false};
 
     /**
-     * @brief The address for RTMP streaming.
+     * @brief Frames the archive queue buffers in front of the encoder, in
+     * milliseconds. The oldest frames are dropped when it is full.
      */
-    std::string rtmp_streaming_addr;
+    uint queue_time_ms = 10000;
+
+    /**
+     * @brief Nice value the archive streaming thread is set to, inherited by
+     * the encoder threads it starts. It replaces the nice value of the
+     * process for that thread, and values below it need CAP_SYS_NICE.
+     */
+    int niceness = 10;
+};
+
+/**
+ * @brief Construction time settings of an RtmpStreamer.
+ *
+ * Every member has a default matching the behaviour of the plain
+ * constructors, so only the settings of interest need to be changed.
+ */
+struct StreamerConfig {
+    /**
+     * @brief The encoder of the RTMP bin and its settings.
+     *
+     * The encoder must be installed and produce a codec FLV can carry
+     * (x264, openh264 or vaapih264enc), otherwise construction fails.
+     */
+    EncoderSettings encoder;
+
+    /**
+     * @brief The sink the local video stream is rendered to.
+     */
+    PreviewSink preview_sink = PreviewSink::Window;
+
+    /**
+     * @brief Pixel width of the local video stream, 0 keeps the input width.
+     */
+    uint preview_width = 0;
+
+    /**
+     * @brief Pixel height of the local video stream, 0 keeps the input
+     * height.
+     */
+    uint preview_height = 0;
+
+    /**
+     * @brief Frame rate of the local video stream, 0 keeps the output rate.
+     */
+    int preview_frame_rate = 0;
+
+    /**
+     * @brief Socket path used when `preview_sink` is PreviewSink::SharedMemory.
+     */
+    std::string preview_shm_path = "/tmp/rtmp-streamer-preview";
+
+    /**
+     * @brief Burns the wall-clock time into every output frame.
+     */
+    bool overlay_clock = false;
+
+    /**
+     * @brief strftime format of the clock overlay, in the local time zone of
+     * the process (run with TZ=UTC for UTC).
+     */
+    std::string overlay_clock_format = "%Y-%m-%d %H:%M:%S";
+
+    /**
+     * @brief Burns the text set through `set_overlay_text` into every output
+     * frame.
+     */
+    bool overlay_text = false;
+
+    /**
+     * @brief Pango font description used by the overlays.
+     */
+    std::string overlay_font = "Sans 16";
+
+    /**
+     * @brief Convert frames to I420 with the built-in SIMD converter in
+     * `send_frame`, so videoconvert runs in passthrough and the conversion
+     * leaves the streaming thread. When false, RGB frames are pushed and
+     * converted by videoconvert.
+     */
+    bool ingest_i420 = true;
+
+    /**
+     * @brief Number of threads of every videoconvert and videoscale element,
+     * each working on a stripe of the frame. 0 uses one thread per core.
+     * Raise it for 4K sources, where a single thread per element caps the
+     * frame rate.
+     */
+    uint convert_threads = 1;
+
+    /**
+     * @brief Automatic reconnection to the RTMP server.
+     */
+    ReconnectConfig reconnect;
+
+    /**
+     * @brief Embeds a frame ID and the wall-clock times of `send_frame`, the
+     * encoder input and the encoder output into every frame, as an H.264
+     * SEI message. A receiver reads them with `find_timestamp_sei` or
+     * `LatencyRecorder` to measure the latency per stage. Adds about 60
+     * bytes per frame, and is ignored for encoders other than H.264.
+     */
+    bool embed_timestamps = false;
+};
+
+class RtmpStreamer {
+   public:
+
+    /**
+     * @brief Default constructor for the RtmpStreamer class.
+     *
+     * The `RtmpStreamer` constructor initializes the streamer with a default
+     * video input resolution of 1024x1024. Default RTMP server is
+     * 'rtmp://ome.waraps.org/app/name-your-stream'. 
+     */
+    RtmpStreamer();
+
+    /**
+     * @brief Constructs an RtmpStreamer with specified width and height.
+     *
+     * @param width The pixel width of each input frame.
+     * @param height The pixel height of each input frame.
+     * @param rtmp_streaming_addr The address of the RTMP server to stream to.
+     *
+     * NOTE: The last part of the streaming address becomes the name of stream
+     *
+     */
+    RtmpStreamer(uint width, uint height, const char *rtmp_streaming_addr);
+
+    /**
+     * @brief Constructs an RtmpStreamer with specified width, height and
+     * settings.
+     *
+     * @param width The pixel width of each input frame.
+     * @param height The pixel height of each input frame.
+     * @param rtmp_streaming_addr The address of the RTMP server to stream to.
+     * @param config Settings for the pipeline, see StreamerConfig.
+     */
+    RtmpStreamer(uint width, uint height, const char *rtmp_streaming_addr,
+                 const StreamerConfig &config);
+
+    /**
+     * @brief Deleted copy constructor to prevent copying of RtmpStreamer
+     * instances.
+     */
+    RtmpStreamer(const RtmpStreamer &) = delete;
+
+    /**
+     * @brief Deleted copy assignment operator to prevent copying of
+     * RtmpStreamer instances.
+     */
+    RtmpStreamer &operator=(const RtmpStreamer &) = delete;
+
+    /**
+     * @brief Destructor for the RtmpStreamer class.
+     *
+     * Cleans up and releases resources held by the RtmpStreamer instance.
+     */
+    ~RtmpStreamer();
+
+    /**
+     * @brief Sends a video frame to the GStreamer pipeline for streaming.
+     *
+     * The cv::Mat frame must be in the format of either RGBA or ARGB.
+     *
+     * @param frame The video frame to be sent, represented as an OpenCV Mat
+     * object.
+     * @param regions Regions to encode at a different quality, may be empty.
+     * @return True if the frame was successfully sent; false otherwise, also
+     * when regions are given and the encoder does not support them.
+     */
+    bool send_frame(cv::Mat &frame,
+                    const std::vector<RegionOfInterest> &regions = {});
+
+    /**
+     * @brief Sends a video frame to the GStreamer pipeline for streaming.
+     *
+     * The Frame must be in the format of RGB.
+     *
+     * @param frame Pointer to the raw video frame data.
+     * @param size The size of the video frame data in bytes.
+     * @param regions Regions to encode at a different quality, may be empty.
+     * @return True if the frame was successfully sent; false otherwise, also
+     * when regions are given and the encoder does not support them.
+     */
+    bool send_frame(unsigned char *frame, size_t size,
+                    const std::vector<RegionOfInterest> &regions = {});
+
+    /**
+     * @brief Copies the latest frame of the local video stream.
+     *
+     * Only available when the preview sink is PreviewSink::App. Frames are
+     * delivered in BGR format at the preview resolution.
+     *
+     * @param frame The cv::Mat to copy the frame into.
+     * @param timeout_ms How long to wait for a frame in milliseconds.
+     * @return True if a frame was copied; false otherwise.
+     */
+    bool pull_preview_frame(cv::Mat &frame, uint timeout_ms);
+
+    /**
+     * @brief Changes the resolution of the frames passed to `send_frame`
+     * without rebuilding the pipeline.
+     *
+     * Updates the appsrc caps so the new size is renegotiated downstream with
+     * the next frame, and forces a keyframe at the switch. Frames of the new
+     * size must only be sent once this function has returned.
+     *
+     * @param width The new pixel width of each input frame.
+     * @param height The new pixel height of each input frame.
+     * @param keep_output_resolution If true, videoscale keeps the output at
+     * its current resolution; otherwise the output follows the input.
+     * @return True if the caps were updated; false otherwise.
+     */
+    bool set_input_resolution(uint width, uint height,
+                              bool keep_output_resolution);
+
+    /**
+     * @brief Changes the frame rate at which frames are passed to
+     * `send_frame`.
+     *
+     * Only the timestamps and caps of the input change, videorate keeps the
+     * output at the output frame rate.
+     *
+     * @param frame_rate The new input frame rate; must be larger than 0.
+     * @return True if the caps were updated; false otherwise.
+     */
+    bool set_input_frame_rate(int frame_rate);
+
+    /**
+     * @brief Changes the frame rate of the stream leaving the source bin
+     * without reconnecting to the server.
+     *
+     * Lowering it, e.g. to 15 fps, relieves the encoder under CPU pressure.
+     * videorate drops or duplicates input frames to match the new rate.
+     *
+     * A GOP given in milliseconds is kept by converting it into frames at
+     * the new rate. Encoders that can only change their keyframe interval
+     * before they are started, x264enc among them, refuse this while
+     * playing, so the frame rate is then left unchanged.
+     *
+     * @param frame_rate The new output frame rate; must be larger than 0.
+     * @return True if the caps were updated; false otherwise.
+     */
+    bool set_output_frame_rate(int frame_rate);
+
+    /**
+     * @brief Changes the target bitrate of the encoder without restarting
+     * the pipeline.
+     *
+     * The new bitrate is set through the encoder property, which the encoder
+     * picks up from the next frame it encodes; with x264 the rate control
+     * converges on it within the current GOP. The property is set under the
+     * encoder's object lock, so it is safe to call while another thread is in
+     * `send_frame`.
+     *
+     * @param kbps The new target bitrate in kbit/s.
+     * @return True if the encoder accepted the bitrate; false if it is 0 or
+     * outside the range of the encoder property.
+     */
+    bool set_bitrate(uint kbps);
+
+    /**
+     * @brief Enables the network-aware adaptive bitrate controller.
+     *
+     * The controller watches the fill level of the RTMP queue, the bytes
+     * rtmp2sink writes to the server and the output rate of the encoder, and
+     * steps the bitrate (and optionally the resolution) of the RTMP stream
+     * down and up to keep the latency bounded. It overrides bitrates set
+     * through `set_bitrate` while enabled.
+     *
+     * @param abr_config Settings of the controller.
+     */
+    void enable_adaptive_bitrate(const AdaptiveBitrateConfig &abr_config);
+
+    /**
+     * @brief Disables the adaptive bitrate controller, keeping the current
+     * bitrate and resolution.
+     */
+    void disable_adaptive_bitrate();
+
+    /**
+     * @brief Enables the CPU QoS controller.
+     *
+     * The speed preset is only changed for encoders that accept a new preset
+     * while playing, and never made slower than the one in the encoder
+     * settings. Otherwise the controller only skips frames.
+     *
+     * @param qos_config Settings of the controller.
+     * @param callback Receives every decision, may be nullptr. It must not
+     * enable or disable a controller.
+     */
+    void enable_cpu_qos(const CpuQosConfig &qos_config,
+                        CpuQosEventCallback callback = nullptr);
+
+    /**
+     * @brief Disables the CPU QoS controller and encodes every frame again,
+     * keeping the current speed preset.
+     */
+    void disable_cpu_qos();
+
+    /**
+     * @brief Registers a callback receiving the encoded video stream.
+     *
+     * Access units are taken from an appsink branch after the encoder, run
+     * through the parser of the encoder profile so H.264 arrives in
+     * byte-stream format with SPS/PPS in front of every keyframe. The branch
+     * is only fed while a callback is registered, and a keyframe is requested
+     * when one is set. The callback runs on the appsink streaming thread
+     * behind a leaky queue, so a slow callback drops packets instead of
+     * stalling the RTMP stream. Requires the RTMP bin to be connected, in
+     * standby or not.
+     *
+     * @param callback The callback, or nullptr to stop receiving packets.
+     */
+    void set_encoded_packet_callback(EncodedPacketCallback callback);
+
+    /**
+     * @brief Sets the text burnt into every output frame.
+     *
+     * Requires `overlay_text` to be enabled in the StreamerConfig. The glyphs
+     * are only rendered again when the text changes, and the blending runs
+     * on the streaming thread instead of the caller's thread.
+     *
+     * @param text The text to show, may contain Pango markup.
+     * @return True if the text overlay was updated; false otherwise.
+     */
+    bool set_overlay_text(const std::string &text);
+
+    /**
+     * @brief Returns the most recent frame encoded as JPEG.
+     *
+     * The source bin keeps a reference to the last frame it produced; it is
+     * only encoded when a snapshot is requested, and the result is cached
+     * until a new frame arrives, so idle streams cost no encoding work.
+     *
+     * @return The JPEG data, or an empty vector if no frame is available.
+     */
+    std::vector<uint8_t> snapshot();
+
+    /**
+     * @brief Starts the whole streaming pipeline.
+     *
+     * Will start both the local stream and the stream to the RTMP server.
+     */
+    void start_stream();
+
+    /**
+     * @brief Stops the whole streaming pipeline.
+     *
+     * Will stop both the local stream and the stream to the RTMP server.
+     */
+    void stop_stream();
+
+    /**
+     * @brief Pauses the whole streaming pipeline without tearing it down.
+     *
+     * The pipeline is taken to GST_STATE_PAUSED with every bin still linked,
+     * so encoder contexts, sockets and buffers stay allocated and
+     * `resume_stream` does not pay the full start-up cost again. Frames sent
+     * while paused are rejected.
+     */
+    void pause_stream();
+
+    /**
+     * @brief Resumes a pipeline paused by `pause_stream`.
+     *
+     * Takes the pipeline back to GST_STATE_PLAYING and requests a keyframe.
+     */
+    void resume_stream();
+
+    /**
+     * @brief Returns a snapshot of the pipeline metrics.
+     *
+     * @return The current StreamerMetrics.
+     */
+    StreamerMetrics get_metrics() const;
+
+    /**
+     * @brief Starts the stream to the RTMP server.
+     */
+    void start_rtmp_stream();
+
+    /**
+     * @brief Stops the stream to the RTMP server.
+     */
+    void stop_rtmp_stream();
+
+    /**
+     * @brief Starts the local video stream.
+     */
+    void start_local_stream();
+
+    /**
+     * @brief Stops the local video stream.
+     */
+    void stop_local_stream();
+
+    /**
+     * @brief Starts a low-rate raw frame stream for analytics consumers.
+     *
+     * Connects an appsink branch to the source tee with its own videorate,
+     * videoscale and videoconvert behind a leaky queue, so a slow consumer
+     * drops analytics frames instead of stalling the other streams.
+     *
+     * @param width The pixel width of the delivered frames.
+     * @param height The pixel height of the delivered frames.
+     * @param frame_rate The frame rate of the delivered frames; must not be
+     * higher than the output frame rate.
+     * @param callback Called on the appsink streaming thread for each frame.
+     */
+    void start_analytics_stream(uint width, uint height, int frame_rate,
+                                RawFrameCallback callback);
+
+    /**
+     * @brief Stops the analytics stream and releases its bin.
+     */
+    void stop_analytics_stream();
+
+    /**
+     * @brief Starts recording a high quality archive to a local file.
+     *
+     * Connects a second encoder branch to the source tee, independent of the
+     * RTMP stream. Its queue is leaky and its threads run at lower priority,
+     * so an overloaded archive encoder drops archive frames instead of
+     * adding latency to the live stream.
+     *
+     * @param archive_config Settings of the recording.
+     * @return True if the recording started; false otherwise.
+     */
+    bool start_archive(const ArchiveConfig &archive_config);
+
+    /**
+     * @brief Stops the recording, finalizes the file and releases the
+     * archive branch.
+     *
+     * Frames still queued in the archive branch are encoded first, which may
+     * take up to a few seconds.
+     */
+    void stop_archive();
+
+    /**
+     * @brief Puts the stream to the RTMP server in warm standby.
+     *
+     * The RTMP bin is connected if it is not already and the encoder keeps
+     * running, but a valve holds back its output so nothing reaches the
+     * server. Use `resume_rtmp_stream` to open the valve again.
+     */
+    void standby_rtmp_stream();
+
+    /**
+     * @brief Resumes an RTMP stream that is in standby.
+     *
+     * Opens the valve and forces a keyframe so the resumed stream starts on a
+     * decodable frame. Starts the RTMP stream if it is not connected.
+     */
+    void resume_rtmp_stream();
+
+    /**
+     * @brief Asks the encoder to produce a keyframe as soon as possible.
+     *
+     * Sends a force-key-unit event upstream into the encoder so that new
+     * viewers do not have to wait for the next GOP boundary. Called
+     * automatically whenever a sink bin is connected to the source bin.
+     *
+     * @return True if the request was handled by the encoder; false if the
+     * RTMP bin is not connected or the encoder rejected the request.
+     */
+    bool request_keyframe();
+
+    /**
+     * @brief Provides a command-line interface for controlling the RTMP and
+     * local streams.
+     *
+     * The `async_streamer_control_unit` function continuously reads commands
+     * from the standard input and executes the corresponding streamer control
+     * functions based on the input.
+     *
+     * Supported commands:
+     * - `stop_stream`        : Stops the whole stream.
+     * - `start_stream`       : Stops the whole stream.
+     * - `pause_stream`       : Pauses the whole stream.
+     * - `resume_stream`      : Resumes the paused stream.
+     * - `stop_rtmp_stream`   : Stops the RTMP stream.
+     * - `stop_local_stream`  : Stops the local stream.
+     * - `start_rtmp_stream`  : Starts the RTMP stream.
+     * - `start_local_stream` : Starts the local stream.
+     * - `standby_rtmp_stream`: Puts the RTMP stream in standby.
+     * - `resume_rtmp_stream` : Resumes the RTMP stream from standby.
+     * - `request_keyframe`   : Forces a keyframe in the encoded stream.
+     * - `quit`               : Exits the command loop.
+     *
+     * If an invalid command is entered, an error message is printed to the
+     * standard error. The command loop will continue to process commands until
+     * the "quit" command is received.
+     */
+    void async_streamer_control_unit();
+
+    /**
+     * @brief Provides information about all elements connected to the pipeline.
+     *
+     * A debuging tool to display information about the pipeline such as,
+     * available elements, available pads, ghost pads and their linking state.
+     * It also gives information abot the current state of the element.
+     */
+    void debug_info();
+
+   private:
+    /**
+     * @brief Callback function that sets the flag indicating that data is
+     * needed.
+     *
+     * The `cb_need_data` function is a static callback used by the GStreamer
+     * `appsrc` element. It is called by the appsrc element when it needs more
+     * data.
+     *
+     * @param appsrc The GStreamer appsrc element requesting data.
+     * @param size The size of the data needed.
+     * @param user_data A pointer to user data; in this case, a boolean flag
+     * indicating the need for data.
+     */
+    static void cb_need_data(GstAppSrc *appsrc, guint size, gpointer user_data);
+
+    /**
+     * @brief Callback function that resets the flag indicating that no more
+     * data is needed.
+     *
+     * The `cb_enough_data` function is a static callback used by the GStreamer
+     * `appsrc` element. It is called by appsrc when it has enough data.
+     *
+     * @param appsrc The GStreamer appsrc element indicating no more data is
+     * needed.
+     * @param user_data A pointer to user data; in this case, a boolean flag
+     * indicating the need for data.
+     */
+    static void cb_enough_data(GstAppSrc *appsrc, gpointer user_data);
+
+    /**
+     * @brief Synchronous bus handler for messages posted by the pipeline.
+     *
+     * Runs in the thread posting the message. Completes the start and stop
+     * latency measurements when the pipeline reaches its target state,
+     * lowers the priority of the archive streaming thread, and hands errors
+     * of the RTMP output to the reconnection.
+     *
+     * @param bus The pipeline bus.
+     * @param msg The posted message.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return GST_BUS_DROP for RTMP errors handled by reconnecting, so they
+     * never reach `check_error`; GST_BUS_PASS otherwise.
+     */
+    static GstBusSyncReply cb_bus_sync(GstBus *bus, GstMessage *msg,
+                                       gpointer user_data);
+
+    /**
+     * @brief Callback pulling encoded samples from the encoded packet appsink
+     * and handing them to the registered EncodedPacketCallback.
+     *
+     * @param sink The appsink with a new sample.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return GST_FLOW_OK, or GST_FLOW_EOS if no sample could be pulled.
+     */
+    static GstFlowReturn cb_new_encoded_sample(GstAppSink *sink,
+                                               gpointer user_data);
+
+    /**
+     * @brief Callback pulling raw samples from the analytics appsink and
+     * handing them to the registered RawFrameCallback as cv::Mat views.
+     *
+     * @param sink The appsink with a new sample.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return GST_FLOW_OK, or GST_FLOW_EOS if no sample could be pulled.
+     */
+    static GstFlowReturn cb_new_analytics_sample(GstAppSink *sink,
+                                                 gpointer user_data);
+
+    /**
+     * @brief Pad probe counting the bytes leaving the encoder.
+     *
+     * @param pad The encoder src pad.
+     * @param info The probe info holding the encoded buffer.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return Always GST_PAD_PROBE_OK.
+     */
+    static GstPadProbeReturn cb_count_encoded_bytes(GstPad *pad,
+                                                    GstPadProbeInfo *info,
+                                                    gpointer user_data);
+
+    /**
+     * @brief Pad probe skipping frames for the CPU QoS controller and
+     * timestamping the frames that enter the encoder.
+     *
+     * @param pad The encoder sink pad.
+     * @param info The probe info holding the raw frame.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return GST_PAD_PROBE_DROP for skipped frames, GST_PAD_PROBE_OK
+     * otherwise.
+     */
+    static GstPadProbeReturn cb_encoder_input(GstPad *pad,
+                                              GstPadProbeInfo *info,
+                                              gpointer user_data);
+
+    /**
+     * @brief Pad probe measuring the encode time of the frames leaving the
+     * encoder.
+     *
+     * @param pad The encoder src pad.
+     * @param info The probe info holding the encoded buffer.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return Always GST_PAD_PROBE_OK.
+     */
+    static GstPadProbeReturn cb_encoder_output(GstPad *pad,
+                                               GstPadProbeInfo *info,
+                                               gpointer user_data);
+
+    /**
+     * @brief Pad probe signalling that EOS reached the archive file sink.
+     *
+     * @param pad The filesink sink pad.
+     * @param info The probe info holding the event.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return Always GST_PAD_PROBE_OK.
+     */
+    static GstPadProbeReturn cb_archive_eos(GstPad *pad, GstPadProbeInfo *info,
+                                            gpointer user_data);
+
+    /**
+     * @brief Pad probe on the frames sent to the RTMP server.
+     *
+     * Keeps the current GOP in the replay buffer, drops frames while the
+     * connection is being reestablished, and replays the buffer into the
+     * restarted muxer ahead of the first frame after a reconnect.
+     *
+     * @param pad The rtmp valve src pad.
+     * @param info The probe info holding the buffer.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return GST_PAD_PROBE_DROP for frames that must not reach the muxer;
+     * GST_PAD_PROBE_OK otherwise.
+     */
+    static GstPadProbeReturn cb_rtmp_output(GstPad *pad, GstPadProbeInfo *info,
+                                            gpointer user_data);
+
+    /**
+     * @brief Pad probe inserting the timestamp SEI into every encoded frame
+     * that carries the ingest meta.
+     *
+     * The SEI is placed after the access unit delimiter, if there is one,
+     * and the frame memory is shared rather than copied.
+     *
+     * @param pad The encoder src pad.
+     * @param info The probe info holding the buffer.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return Always GST_PAD_PROBE_OK.
+     */
+    static GstPadProbeReturn cb_embed_timestamps(GstPad *pad,
+                                                 GstPadProbeInfo *info,
+                                                 gpointer user_data);
+
+    /**
+     * @brief Pad probe that drops encoded buffers until a keyframe passes.
+     *
+     * Installed on the RTMP valve when resuming from standby so the server
+     * never receives delta frames it cannot decode. Removes itself once the
+     * first keyframe has gone through.
+     */
+    static GstPadProbeReturn cb_drop_until_keyframe(GstPad *pad,
+                                                    GstPadProbeInfo *info,
+                                                    gpointer user_data);
+
+    /**
+     * @brief Pad probe forcing a keyframe whenever a frame enters the
+     * encoder after a GOP boundary on the wall clock.
+     *
+     * @param pad The encoder sink pad.
+     * @param info The probe info holding the raw frame.
+     * @param user_data A pointer to the owning RtmpStreamer.
+     * @return Always GST_PAD_PROBE_OK.
+     */
+    static GstPadProbeReturn cb_align_keyframe(GstPad *pad,
+                                               GstPadProbeInfo *info,
+                                               gpointer user_data);
+
+    /**
+     * @brief Connects a sink bin to a source bin in a GStreamer pipeline.
+     *
+     * This function adds a sink bin to the pipeline and links it to a
+     * source bin using a tee element. Does not change pipeline state but sets
+     * sink element to GST_PLAYING. A keyframe is requested once the bin is
+     * linked so the new consumer can start decoding immediately.
+     *
+     * NOTE: Source element must contain a tee element.
+     *
+     * @param source_bin The source bin element to connect from.
+     * @param sink_bin The sink bin element to connect to. 
+     * NOTE: Transfers ownership of sink_bin to the pipeline
+     *
+     * @param request_pad A place to store the requested pad from the tee
+     * element.
+     * @param tee_element_name The name of the tee element within the source
+     * bin.
+     * @param tee_ghost_pad_name The name of the ghost pad to create in the
+     * source bin.
+     * @return true if the connection was successful, false otherwise.
+     */
+    bool connect_sink_bin_to_source_bin(GstElement *source_bin,
+                                        GstElement **sink_bin,
+                                        GstPad **request_pad,
+                                        const char *tee_element_name,
+                                        const char *tee_ghost_pad_name);
+
+    /**
+     * @brief Disconnects a sink bin from a source bin in the GStreamer
+     * pipeline.
+     *
+     * @param source_bin The source bin from which to disconnect.
+     * @param sink_bin Location to store the removed sink-bin
+     * @param request_pad The pad from the tee element to be disconnected.
+     * @param sink_bin_name The name of the sink bin to remove
+     * @param tee_ghost_pad_name The name of the ghost pad in the source
+     * bin.
+     * @return True if the disconnection is successful, otherwise false.
+     *
+     * @side-effect Transfers ownership of removed sink-bin to 
+     */
+    bool disconnect_sink_bin_from_source_bin(GstElement *source_bin,
+                                             GstElement **sink_bin,
+                                             GstPad *request_pad,
+                                             const char *sink_bin_name,
+                                             const char *tee_ghost_pad_name);
+
+    /**
+     * @brief Sends a frame to the appsrc element.
+     *
+     * @param data Pointer to the packed 24-bit frame data.
+     * @param size Size of the frame data in bytes.
+     * @param order Channel order of the frame data.
+     * @param regions Regions attached to the buffer as ROI meta.
+     * @return True if the frame is successfully sent, otherwise false.
+     */
+    bool send_frame_to_appsrc(void *data, size_t size, ChannelOrder order,
+                              const std::vector<RegionOfInterest> &regions);
+
+    /**
+     * @brief Configures `ingest_pool` for the current input resolution and
+     * activates it.
+     *
+     * @return True if the pool was activated; false otherwise.
+     */
+    bool configure_ingest_pool();
+
+    /**
+     * @brief Attaches regions of interest to a buffer, clipped to the input
+     * frame.
+     *
+     * @param buffer The buffer to attach the regions to.
+     * @param regions The regions to attach.
+     */
+    void add_region_of_interest_meta(
+        GstBuffer *buffer, const std::vector<RegionOfInterest> &regions);
+
+    /**
+     * @brief Connects the signal handlers for appsrc's need-data and
+     * enough-data signals.
+     *
+     * @return True if the signal handlers are successfully connected, false
+     * otherwise.
+     */
+    bool connect_appsrc_signal_handler();
+
+    /**
+     * @brief Disconnects the signal handlers for appsrc's need-data and
+     * enough-data signals.
+     *
+     * @return True if the signal handlers are successfully disconnected, false
+     * otherwise.
+     */
+    bool disconnect_appsrc_signal_handler();
+
+    /**
+     * @brief Checks for errors in the streaming process.
+     *
+     * NOTE: Should be run async with the program.
+     *
+     * @return True if there is an error, otherwise false.
+     */
+    [[nodiscard, maybe_unused]] bool check_error() const;
+
+    /**
+     * @brief Body of the monitor thread.
+     *
+     * Wakes up periodically to refresh the network metrics and to run the
+     * controllers that are enabled, until the streamer is destroyed.
+     */
+    void monitor_loop();
+
+    /**
+     * @brief Refreshes the bitrate and queue metrics of the RTMP bin.
+     *
+     * @param elapsed_seconds Time since the previous refresh.
+     */
+    void update_network_metrics(double elapsed_seconds);
+
+    /**
+     * @brief Makes one decision of the adaptive bitrate controller.
+     */
+    void adaptive_bitrate_step();
+
+    /**
+     * @brief Sets the target bitrate of the encoder, with `monitor_mutex`
+     * held.
+     *
+     * @param kbps The new target bitrate in kbit/s.
+     * @return True if the encoder accepted the bitrate; false otherwise.
+     */
+    bool apply_bitrate(uint kbps);
+
+    /**
+     * @brief Refreshes the encoder load from the frames encoded since the
+     * previous refresh.
+     */
+    void update_encoder_metrics();
+
+    /**
+     * @brief Makes one decision of the CPU QoS controller.
+     */
+    void cpu_qos_step();
+
+    /**
+     * @brief Advances the reconnection to the RTMP server, if the
+     * connection was lost.
+     *
+     * @param now The time of the current monitor wake up.
+     */
+    void reconnect_step(std::chrono::steady_clock::time_point now);
+
+    /**
+     * @brief Restarts the muxer and rtmp2sink of the RTMP bin, which opens a
+     * new connection. Frames are let through again by `reconnect_step` once
+     * the connection has written data.
+     *
+     * @return True if the elements were restarted; false otherwise.
+     */
+    bool restart_rtmp_sink();
+
+    /**
+     * @brief Lifts the buffer and time limits of the RTMP queue, so it takes
+     * the whole replay buffer without blocking the encoder.
+     *
+     * @param queue The RTMP queue.
+     */
+    void widen_rtmp_queue(GstElement *queue);
+
+    /**
+     * @brief Restores the usual limits of the RTMP queue once it holds less
+     * than they allow.
+     *
+     * @param force Restore them regardless of the fill level.
+     */
+    void narrow_rtmp_queue(bool force);
+
+    /**
+     * @brief Forgets an ongoing reconnection, when the RTMP bin is stopped.
+     */
+    void reset_reconnect();
+
+    /**
+     * @brief Adds an encoded frame to the replay buffer, which restarts at
+     * every keyframe.
+     *
+     * @param buffer The encoded frame.
+     */
+    void store_replay_packet(GstBuffer *buffer);
+
+    /**
+     * @brief Empties the replay buffer, with `replay_mutex` held.
+     */
+    void clear_replay_packets();
+
+    /**
+     * @brief Switches the encoder to another speed preset while playing.
+     *
+     * @param preset The name of the preset.
+     * @return True if the encoder accepted the preset; false otherwise.
+     */
+    bool set_speed_preset(const std::string &preset);
+
+    /**
+     * @brief Scales the stream sent to the RTMP server.
+     *
+     * @param scale Fraction of the input resolution, 1 disables scaling.
+     * @return True if the RTMP caps were updated; false otherwise.
+     */
+    bool set_rtmp_output_scale(double scale);
+
+    /**
+     * @brief Changes the pipeline state and starts timing the change.
+     *
+     * @param state The state to take the pipeline to.
+     */
+    void set_pipeline_state(GstState state);
+
+    /**
+     * @brief Stores the latency of a pending state change once the pipeline
+     * has reached its target state.
+     *
+     * @param state The state the pipeline has reached.
+     */
+    void record_state_change(GstState state);
+
+    /**
+     * @brief Looks up an element by name in the pipeline or in one of the
+     * currently disconnected sink bins. Safe to call from the monitor thread
+     * while the bins are connected or disconnected.
+     *
+     * @param name The name of the element.
+     * @return A new reference to the element, or nullptr if not found.
+     */
+    GstElement *get_element_by_name(const char *name);
+
+    /**
+     * @brief Opens or closes the valve gating the output of the RTMP bin.
+     *
+     * @param drop True to hold back the encoded stream, false to let it pass.
+     * @return True if the valve was found and updated, otherwise false.
+     */
+    bool set_rtmp_valve_drop(bool drop);
+
+    gboolean check_links();
+    void initialize_streamer();
+
+    /**
+     * @brief Mutex for synchronizing access to the want_data flag.
+     */
+    static std::mutex want_data_muxex;
+
+    /**
+     * @brief Mutex for synchronizing access to the pipeline handling process.
+     */
+    static std::mutex handling_pipeline;
+
+    /**
+     * @brief Mutex for synchronizing access to the metrics and the state
+     * change being timed.
+     */
+    mutable std::mutex metrics_mutex;
+
+    /**
+     * @brief Construction time settings of the pipeline.
+     */
+    StreamerConfig config;
+
+    /**
+     * @brief The width of the screen or video frame.
+     */
+    uint screen_width;
+
+    /**
+     * @brief The height of the screen or video frame.
+     */
+    uint screen_height;
+
+    /**
+     * @brief The width of the frames leaving the source bin.
+     */
+    uint output_width = 0;
+
+    /**
+     * @brief The height of the frames leaving the source bin.
+     */
+    uint output_height = 0;
+
+    /**
+     * @brief The frame rate at which frames are passed to `send_frame`.
+     */
+    int frame_rate_in = 30;
+
+    /**
+     * @brief The frame rate of the frames leaving the source bin.
+     */
+    int frame_rate_out = 30;
+
+    /**
+     * @brief Flag indicating whether data is needed by appsrc.
+     */
+    bool want_data;
+
+    /**
+     * @brief Flag indicating whether the RTMP bin is held in standby.
+     */
+    bool rtmp_standby;
+
+    /**
+     * @brief Flag indicating whether the pipeline is paused by
+     * `pause_stream`.
+     */
+    bool stream_paused;
+
+    /**
+     * @brief The number of bins currently connected to the source bin.
+     */
+    int connected_bins_to_source;
+
+    /**
+     * @brief The GStreamer pipeline element.
+     */
+    GstElement *pipeline;
+
+    /**
+     * @brief The source bin element in the GStreamer pipeline.
+     */
+    GstElement *source_bin;
+
+    /**
+     * @brief The RTMP bin element in the GStreamer pipeline.
+     */
+    GstElement *rtmp_bin;
+
+    /**
+     * @brief The local video bin element in the GStreamer pipeline.
+     */
+    GstElement *local_video_bin;
+
+    /**
+     * @brief Reference to the RTMP bin held for the lifetime of the
+     * streamer. Unlike `rtmp_bin`, it is never reassigned while the bin is
+     * connected and disconnected.
+     */
+    GstElement *rtmp_bin_ref = nullptr;
+
+    /**
+     * @brief Reference to the local video bin held for the lifetime of the
+     * streamer.
+     */
+    GstElement *local_video_bin_ref = nullptr;
+
+    /**
+     * @brief The name of the source bin element.
+     */
+    gchar *source_bin_name;
+
+    /**
+     * @brief The name of the RTMP bin element.
+     */
+    gchar *rtmp_bin_name;
+
+    /**
+     * @brief The name of the local video bin element.
+     */
+    gchar *local_video_bin_name;
+
+    /**
+     * @brief The appsrc element for pushing frames into the GStreamer pipeline.
+     */
+    GstElement *appsrc;
+
+    /**
+     * @brief Pool of the I420 buffers frames are converted into, only used
+     * when `ingest_i420` is set.
+     */
+    GstBufferPool *ingest_pool = nullptr;
+
+    /**
+     * @brief Layout of the buffers of `ingest_pool`.
+     */
+    GstVideoInfo ingest_info;
+
+    /**
+     * @brief The pad of the RTMP tee element.
+     */
+    GstPad *src_rtmp_tee_pad;
+
+    /**
+     * @brief The pad of the local video tee element.
+     */
+    GstPad *src_local_tee_pad;
+
+    /**
+     * @brief ID for the need-data signal handler for appsrc.
+     */
+    gint appsrc_need_data_id;
+
+    /**
+     * @brief ID for the enough-data signal handler appsrc.
+     */
+    gint appsrc_enough_data_id;
+
+    /**
+     * @brief The GStreamer bus element for handling messages from the pipeline.
+     */
+    GstBus *bus;
+
+    /**
+     * @brief The address for RTMP streaming.
+     */
+    std::string rtmp_streaming_addr;
+
+    /**
+     * @brief Callback receiving encoded packets, may be empty.
+     */
+    EncodedPacketCallback encoded_packet_callback;
+
+    /**
+     * @brief Mutex for synchronizing access to `encoded_packet_callback`.
+     */
+    std::mutex encoded_packet_mutex;
+
+    /**
+     * @brief The analytics bin while it is built but not connected.
+     */
+    GstElement *analytics_bin = nullptr;
+
+    /**
+     * @brief The pad of the analytics tee element.
+     */
+    GstPad *src_analytics_tee_pad = nullptr;
+
+    /**
+     * @brief Callback receiving analytics frames, may be empty.
+     */
+    RawFrameCallback analytics_callback;
+
+    /**
+     * @brief Mutex for synchronizing access to `analytics_callback`.
+     */
+    std::mutex analytics_mutex;
+
+    /**
+     * @brief The archive bin while it is built but not connected, or being
+     * finalized.
+     */
+    GstElement *archive_bin = nullptr;
+
+    /**
+     * @brief The pad of the archive tee element.
+     */
+    GstPad *src_archive_tee_pad = nullptr;
+
+    /**
+     * @brief Nice value of the archive streaming thread.
+     */
+    std::atomic<int> archive_niceness{0};
+
+    /**
+     * @brief Flag indicating whether EOS reached the archive file sink.
+     */
+    bool archive_eos = false;
+
+    /**
+     * @brief Mutex for synchronizing access to `archive_eos`.
+     */
+    std::mutex archive_mutex;
+
+    /**
+     * @brief Wakes `stop_archive` up when the file is finalized.
+     */
+    std::condition_variable archive_cv;
+
+    /**
+     * @brief The frame the cached snapshot was encoded from.
+     */
+    GstBuffer *snapshot_buffer = nullptr;
+
+    /**
+     * @brief The cached JPEG encoding of `snapshot_buffer`.
+     */
+    std::vector<uint8_t> snapshot_jpeg;
+
+    /**
+     * @brief Mutex for synchronizing access to the snapshot cache.
+     */
+    std::mutex snapshot_mutex;
+
+    /**
+     * @brief Thread running `monitor_loop`.
+     */
+    std::thread monitor_thread;
+
+    /**
+     * @brief Flag keeping the monitor thread alive.
+     */
+    bool monitor_running = false;
+
+    /**
+     * @brief Mutex for synchronizing access to the controllers run by the
+     * monitor thread.
+     */
+    std::mutex monitor_mutex;
+
+    /**
+     * @brief Wakes the monitor thread up when it should stop.
+     */
+    std::condition_variable monitor_cv;
+
+    /**
+     * @brief Total number of bytes that left the encoder.
+     */
+    std::atomic<guint64> encoded_bytes_total{0};
+
+    /**
+     * @brief Timestamps and sizes of the encoded buffers of the last second
+     * of stream time, only used on the encoder streaming thread and cleared
+     * by `stop_rtmp_stream` once the pipeline is stopped.
+     */
+    std::deque<std::pair<GstClockTime, gsize>> bitrate_window;
+
+    /**
+     * @brief Sum of the sizes in `bitrate_window`.
+     */
+    guint64 bitrate_window_bytes = 0;
+
+    /**
+     * @brief Largest `bitrate_window_bytes` since the last metrics refresh.
+     */
+    std::atomic<guint64> peak_window_bytes{0};
+
+    /**
+     * @brief `encoded_bytes_total` at the previous metrics refresh.
+     */
+    guint64 last_encoded_bytes_total = 0;
+
+    /**
+     * @brief Bytes written by rtmp2sink at the previous metrics refresh.
+     */
+    guint64 last_rtmp_bytes_total = 0;
+
+    /**
+     * @brief Flag indicating whether the adaptive bitrate controller runs.
+     */
+    bool adaptive_bitrate_enabled = false;
+
+    /**
+     * @brief Settings of the adaptive bitrate controller.
+     */
+    AdaptiveBitrateConfig adaptive_bitrate_config;
+
+    /**
+     * @brief Consecutive healthy intervals seen by the controller.
+     */
+    uint adaptive_bitrate_healthy_intervals = 0;
+
+    /**
+     * @brief When the controller made its last decision.
+     */
+    std::chrono::steady_clock::time_point adaptive_bitrate_last_step;
+
+    /**
+     * @brief Fraction of the input resolution sent to the RTMP server.
+     */
+    double rtmp_output_scale = 1.0;
+
+    /**
+     * @brief Guards the encode time bookkeeping of the encoder probes.
+     */
+    std::mutex encode_time_mutex;
+
+    /**
+     * @brief When each frame inside the encoder entered it, by PTS.
+     */
+    std::map<GstClockTime, std::chrono::steady_clock::time_point>
+        frames_in_encoder;
+
+    /**
+     * @brief Sum of the encode times since the last metrics refresh in
+     * seconds.
+     */
+    double encode_time_total = 0.0;
+
+    /**
+     * @brief Number of frames encoded since the last metrics refresh.
+     */
+    uint encoded_frames = 0;
+
+    /**
+     * @brief Flag indicating whether the CPU QoS controller runs.
+     */
+    bool cpu_qos_enabled = false;
+
+    /**
+     * @brief Settings of the CPU QoS controller.
+     */
+    CpuQosConfig cpu_qos_config;
+
+    /**
+     * @brief Receives the decisions of the CPU QoS controller.
+     */
+    CpuQosEventCallback cpu_qos_callback;
+
+    /**
+     * @brief The speed preset when the controller was enabled, the slowest
+     * one it switches back to.
+     */
+    std::string cpu_qos_base_preset;
+
+    /**
+     * @brief Consecutive intervals with headroom seen by the controller.
+     */
+    uint cpu_qos_idle_intervals = 0;
+
+    /**
+     * @brief When the controller made its last decision.
+     */
+    std::chrono::steady_clock::time_point cpu_qos_last_step;
+
+    /**
+     * @brief Number of input frames per frame passed to the encoder.
+     */
+    std::atomic<uint> frame_divisor{1};
+
+    /**
+     * @brief Frames seen by the encoder input probe, only used on the
+     * streaming thread.
+     */
+    guint64 encoder_input_frames = 0;
+
+    /**
+     * @brief Number of frames kept from the encoder.
+     */
+    std::atomic<uint64_t> frames_skipped{0};
+
+    /**
+     * @brief Flag set by the bus handler when the RTMP sink fails, and
+     * cleared once the restarted sink has written to the new connection.
+     * Frames to the RTMP server are dropped while it is set.
+     */
+    std::atomic<bool> rtmp_reconnecting{false};
+
+    /**
+     * @brief Flag set by the bus handler for every failure of the RTMP sink,
+     * consumed by the monitor thread.
+     */
+    std::atomic<bool> rtmp_connection_failed{false};
+
+    /**
+     * @brief Flag indicating whether the RTMP sink has written to the server
+     * since the stream was started. Errors are only handled by reconnecting
+     * once it is set.
+     */
+    std::atomic<bool> rtmp_connected_once{false};
+
+    /**
+     * @brief Flag indicating whether the reconnection was abandoned and the
+     * errors of the RTMP sink reach the bus again.
+     */
+    std::atomic<bool> rtmp_reconnect_gave_up{false};
+
+    /**
+     * @brief Flag indicating whether the RTMP connection is down, only used
+     * by the monitor thread.
+     */
+    bool rtmp_outage = false;
+
+    /**
+     * @brief Flag indicating whether the elements were restarted and the
+     * new connection has not sent anything yet.
+     */
+    bool rtmp_awaiting_connection = false;
+
+    /**
+     * @brief When the current outage began.
+     */
+    std::chrono::steady_clock::time_point rtmp_outage_begin;
+
+    /**
+     * @brief When the next reconnection attempt is due.
+     */
+    std::chrono::steady_clock::time_point rtmp_next_attempt;
+
+    /**
+     * @brief The delay before the next attempt, before jitter, in
+     * milliseconds.
+     */
+    double rtmp_reconnect_delay_ms = 0.0;
+
+    /**
+     * @brief Attempts made in the current outage.
+     */
+    uint rtmp_outage_attempts = 0;
+
+    /**
+     * @brief Source of the reconnection jitter.
+     */
+    std::mt19937 reconnect_random{std::random_device{}()};
+
+    /**
+     * @brief The encoded frames since the last keyframe, starting with it,
+     * or nothing if the GOP exceeded the memory cap.
+     */
+    std::deque<GstBuffer *> replay_packets;
+
+    /**
+     * @brief Sum of the sizes in `replay_packets`.
+     */
+    size_t replay_bytes = 0;
+
+    /**
+     * @brief Mutex for synchronizing access to the replay buffer.
+     */
+    std::mutex replay_mutex;
+
+    /**
+     * @brief Flag set when the RTMP output was restarted, consumed by the
+     * next frame on its way to the muxer.
+     */
+    std::atomic<bool> rtmp_restarted{false};
+
+    /**
+     * @brief Flag indicating whether the RTMP queue has the limits of
+     * `widen_rtmp_queue`, guarded by `monitor_mutex`.
+     */
+    bool rtmp_queue_widened = false;
+
+    /**
+     * @brief Flag indicating whether the probe is pushing replayed frames,
+     * only used on the streaming thread.
+     */
+    bool replaying = false;
+
+    /**
+     * @brief Flag indicating whether the restarted muxer still waits for a
+     * keyframe, only used on the streaming thread.
+     */
+    bool rtmp_wait_keyframe = false;
+
+    /**
+     * @brief Reference of the meta carrying the time of `send_frame`
+     * through the pipeline to the encoder output.
+     */
+    GstCaps *ingest_meta_caps = nullptr;
+
+    /**
+     * @brief ID of the next frame passed to `send_frame`.
+     */
+    std::atomic<uint64_t> ingest_frame_id{0};
+
+    /**
+     * @brief GOP interval keyframes are aligned to on the wall clock in
+     * milliseconds, 0 if they are not aligned.
+     */
+    std::atomic<uint> gop_align_interval_ms{0};
+
+    /**
+     * @brief Index of the wall clock GOP of the last frame that entered the
+     * encoder, -1 before the first frame.
+     */
+    gint64 last_gop_boundary = -1;
+
+    /**
+     * @brief Measurements exposed through `get_metrics`.
+     */
+    StreamerMetrics metrics;
+
+    /**
+     * @brief The state the pipeline is currently being taken to.
+     */
+    GstState state_change_target;
+
+    /**
+     * @brief Flag indicating whether a state change is being timed.
+     */
+    bool state_change_pending = false;
+
+    /**
+     * @brief When the state change being timed was started.
+     */
+    std::chrono::steady_clock::time_point state_change_begin;
 };
@@ -0,0 +1,390 @@
+#include "color_convert.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+// BT.709 limited range in 8-bit fixed point:
+//   Y  = 16  + ( 47 R + 157 G +  16 B) / 256
+//   Cb = 128 + (-26 R -  86 G + 112 B) / 256
+//   Cr = 128 + (112 R - 102 G -  10 B) / 256
+// The chroma coefficients sum up to 0, so grey stays exactly at 128.
+
+/**
+ * @brief A routine converting the bulk of a pair of rows, returning the
+ * number of columns it converted. The rest is left to the scalar code.
+ */
+using RowPairKernel = int (*)(const uint8_t *row0, const uint8_t *row1,
+                              ChannelOrder order, int width, uint8_t *y0,
+                              uint8_t *y1, uint8_t *u, uint8_t *v);
+
+static inline uint8_t luma(int r, int g, int b) {
+    return (uint8_t)(((47 * r + 157 * g + 16 * b + 128) >> 8) + 16);
+}
+
+static inline uint8_t chroma_b(int r, int g, int b) {
+    return (uint8_t)(((-26 * r - 86 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline uint8_t chroma_r(int r, int g, int b) {
+    return (uint8_t)(((112 * r - 102 * g - 10 * b + 128) >> 8) + 128);
+}
+
+/**
+ * @brief Converts the columns from `x_begin` of a pair of rows. For the last
+ * row of a frame of odd height, `row1` is `row0` and `y1` is nullptr.
+ */
+static void convert_row_pair_scalar(const uint8_t *row0, const uint8_t *row1,
+                                    ChannelOrder order, int x_begin, int width,
+                                    uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                    uint8_t *v) {
+    int r_index = order == ChannelOrder::RGB ? 0 : 2;
+    int b_index = 2 - r_index;
+
+    for (int x = x_begin; x < width; x += 2) {
+        int pixels = x + 1 < width ? 2 : 1;
+        int r_sum = 0, g_sum = 0, b_sum = 0;
+        for (int i = 0; i < pixels; i++) {
+            const uint8_t *p0 = row0 + 3 * (x + i);
+            const uint8_t *p1 = row1 + 3 * (x + i);
+            y0[x + i] = luma(p0[r_index], p0[1], p0[b_index]);
+            if (y1) {
+                y1[x + i] = luma(p1[r_index], p1[1], p1[b_index]);
+            }
+            r_sum += p0[r_index] + p1[r_index];
+            g_sum += p0[1] + p1[1];
+            b_sum += p0[b_index] + p1[b_index];
+        }
+
+        int count = 2 * pixels;
+        int r = (r_sum + count / 2) / count;
+        int g = (g_sum + count / 2) / count;
+        int b = (b_sum + count / 2) / count;
+        u[x / 2] = chroma_b(r, g, b);
+        v[x / 2] = chroma_r(r, g, b);
+    }
+}
+
+static int convert_row_pair_none(const uint8_t *, const uint8_t *,
+                                 ChannelOrder, int, uint8_t *, uint8_t *,
+                                 uint8_t *, uint8_t *) {
+    return 0;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/**
+ * @brief Shuffle masks spreading one channel of 8 packed pixels into 16-bit
+ * lanes. The pixels are read with two overlapping 16 byte loads at offsets
+ * 0 and 8, so no byte past the 24 bytes of the pixels is touched.
+ */
+struct ChannelMasks {
+    __m128i low;
+    __m128i high;
+};
+
+__attribute__((target("sse4.1"))) static ChannelMasks channel_masks(
+    int channel) {
+    alignas(16) int8_t low[16], high[16];
+    for (int lane = 0; lane < 8; lane++) {
+        int byte = 3 * lane + channel;
+        low[2 * lane] = lane < 5 ? (int8_t)byte : (int8_t)0x80;
+        high[2 * lane] = lane < 5 ? (int8_t)0x80 : (int8_t)(byte - 8);
+        low[2 * lane + 1] = (int8_t)0x80;
+        high[2 * lane + 1] = (int8_t)0x80;
+    }
+    return {_mm_load_si128((const __m128i *)low),
+            _mm_load_si128((const __m128i *)high)};
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i load_channel(
+    __m128i low_bytes, __m128i high_bytes, const ChannelMasks &masks) {
+    return _mm_or_si128(_mm_shuffle_epi8(low_bytes, masks.low),
+                        _mm_shuffle_epi8(high_bytes, masks.high));
+}
+
+/**
+ * @brief Loads 8 packed pixels as 16-bit R, G and B lanes.
+ */
+__attribute__((target("sse4.1"))) static inline void load_pixels(
+    const uint8_t *p, const ChannelMasks masks[3], __m128i &r, __m128i &g,
+    __m128i &b) {
+    __m128i low_bytes = _mm_loadu_si128((const __m128i *)p);
+    __m128i high_bytes = _mm_loadu_si128((const __m128i *)(p + 8));
+    r = load_channel(low_bytes, high_bytes, masks[0]);
+    g = load_channel(low_bytes, high_bytes, masks[1]);
+    b = load_channel(low_bytes, high_bytes, masks[2]);
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i luma_sse(__m128i r,
+                                                                 __m128i g,
+                                                                 __m128i b) {
+    // The weighted sum reaches 56100, so it is kept unsigned
+    __m128i y = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(47)),
+                      _mm_mullo_epi16(g, _mm_set1_epi16(157))),
+        _mm_mullo_epi16(b, _mm_set1_epi16(16)));
+    y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(y, _mm_set1_epi16(16));
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i chroma_sse(
+    __m128i r, __m128i g, __m128i b, short r_weight, short g_weight,
+    short b_weight) {
+    __m128i c = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(r_weight)),
+                      _mm_mullo_epi16(g, _mm_set1_epi16(g_weight))),
+        _mm_mullo_epi16(b, _mm_set1_epi16(b_weight)));
+    c = _mm_srai_epi16(_mm_add_epi16(c, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(c, _mm_set1_epi16(128));
+}
+
+/**
+ * @brief Averages the row sums of two 8 pixel groups over 2x2 blocks.
+ */
+__attribute__((target("sse4.1"))) static inline __m128i average_blocks(
+    __m128i sum0, __m128i sum1) {
+    __m128i sum = _mm_hadd_epi16(sum0, sum1);
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("sse4.1"))) static int convert_row_pair_sse41(
+    const uint8_t *row0, const uint8_t *row1, ChannelOrder order, int width,
+    uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+    int r_channel = order == ChannelOrder::RGB ? 0 : 2;
+    const ChannelMasks masks[3] = {channel_masks(r_channel), channel_masks(1),
+                                   channel_masks(2 - r_channel)};
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r00, g00, b00, r01, g01, b01, r10, g10, b10, r11, g11, b11;
+        load_pixels(row0 + 3 * x, masks, r00, g00, b00);
+        load_pixels(row0 + 3 * x + 24, masks, r01, g01, b01);
+        load_pixels(row1 + 3 * x, masks, r10, g10, b10);
+        load_pixels(row1 + 3 * x + 24, masks, r11, g11, b11);
+
+        _mm_storeu_si128((__m128i *)(y0 + x),
+                         _mm_packus_epi16(luma_sse(r00, g00, b00),
+                                          luma_sse(r01, g01, b01)));
+        _mm_storeu_si128((__m128i *)(y1 + x),
+                         _mm_packus_epi16(luma_sse(r10, g10, b10),
+                                          luma_sse(r11, g11, b11)));
+
+        __m128i r = average_blocks(_mm_add_epi16(r00, r10),
+                                   _mm_add_epi16(r01, r11));
+        __m128i g = average_blocks(_mm_add_epi16(g00, g10),
+                                   _mm_add_epi16(g01, g11));
+        __m128i b = average_blocks(_mm_add_epi16(b00, b10),
+                                   _mm_add_epi16(b01, b11));
+        __m128i cb = chroma_sse(r, g, b, -26, -86, 112);
+        __m128i cr = chroma_sse(r, g, b, 112, -102, -10);
+        _mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(cb, cb));
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(cr, cr));
+    }
+    return x;
+}
+
+__attribute__((target("avx2"))) static inline __m256i luma_avx2(__m256i r,
+                                                                __m256i g,
+                                                                __m256i b) {
+    __m256i y = _mm256_add_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(47)),
+                         _mm256_mullo_epi16(g, _mm256_set1_epi16(157))),
+        _mm256_mullo_epi16(b, _mm256_set1_epi16(16)));
+    y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+    return _mm256_add_epi16(y, _mm256_set1_epi16(16));
+}
+
+__attribute__((target("avx2"))) static inline __m256i chroma_avx2(
+    __m256i r, __m256i g, __m256i b, short r_weight, short g_weight,
+    short b_weight) {
+    __m256i c = _mm256_add_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(r_weight)),
+                         _mm256_mullo_epi16(g, _mm256_set1_epi16(g_weight))),
+        _mm256_mullo_epi16(b, _mm256_set1_epi16(b_weight)));
+    c = _mm256_srai_epi16(_mm256_add_epi16(c, _mm256_set1_epi16(128)), 8);
+    return _mm256_add_epi16(c, _mm256_set1_epi16(128));
+}
+
+/**
+ * @brief Loads 16 packed pixels as 16-bit R, G and B lanes.
+ */
+__attribute__((target("avx2"))) static inline void load_pixels_avx2(
+    const uint8_t *p, const ChannelMasks masks[3], __m256i &r, __m256i &g,
+    __m256i &b) {
+    // 24-bit pixels do not fit the in-lane shuffles of AVX2, so each half
+    // is gathered with 128-bit shuffles
+    __m128i r0, g0, b0, r1, g1, b1;
+    load_pixels(p, masks, r0, g0, b0);
+    load_pixels(p + 24, masks, r1, g1, b1);
+    r = _mm256_set_m128i(r1, r0);
+    g = _mm256_set_m128i(g1, g0);
+    b = _mm256_set_m128i(b1, b0);
+}
+
+/**
+ * @brief Stores 16 lanes of 16-bit values as bytes.
+ */
+__attribute__((target("avx2"))) static inline void store_bytes(uint8_t *dst,
+                                                               __m256i value) {
+    _mm_storeu_si128((__m128i *)dst,
+                     _mm_packus_epi16(_mm256_castsi256_si128(value),
+                                      _mm256_extracti128_si256(value, 1)));
+}
+
+/**
+ * @brief Averages the row sums of two 16 pixel groups over 2x2 blocks.
+ */
+__attribute__((target("avx2"))) static inline __m256i average_blocks_avx2(
+    __m256i sum0, __m256i sum1) {
+    // hadd works within 128-bit lanes, which interleaves the blocks of the
+    // two groups in 64-bit units
+    __m256i sum = _mm256_hadd_epi16(sum0, sum1);
+    sum = _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+__attribute__((target("avx2"))) static int convert_row_pair_avx2(
+    const uint8_t *row0, const uint8_t *row1, ChannelOrder order, int width,
+    uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+    int r_channel = order == ChannelOrder::RGB ? 0 : 2;
+    const ChannelMasks masks[3] = {channel_masks(r_channel), channel_masks(1),
+                                   channel_masks(2 - r_channel)};
+
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i r00, g00, b00, r01, g01, b01, r10, g10, b10, r11, g11, b11;
+        load_pixels_avx2(row0 + 3 * x, masks, r00, g00, b00);
+        load_pixels_avx2(row0 + 3 * x + 48, masks, r01, g01, b01);
+        load_pixels_avx2(row1 + 3 * x, masks, r10, g10, b10);
+        load_pixels_avx2(row1 + 3 * x + 48, masks, r11, g11, b11);
+
+        store_bytes(y0 + x, luma_avx2(r00, g00, b00));
+        store_bytes(y0 + x + 16, luma_avx2(r01, g01, b01));
+        store_bytes(y1 + x, luma_avx2(r10, g10, b10));
+        store_bytes(y1 + x + 16, luma_avx2(r11, g11, b11));
+
+        __m256i r = average_blocks_avx2(_mm256_add_epi16(r00, r10),
+                                        _mm256_add_epi16(r01, r11));
+        __m256i g = average_blocks_avx2(_mm256_add_epi16(g00, g10),
+                                        _mm256_add_epi16(g01, g11));
+        __m256i b = average_blocks_avx2(_mm256_add_epi16(b00, b10),
+                                        _mm256_add_epi16(b01, b11));
+        store_bytes(u + x / 2, chroma_avx2(r, g, b, -26, -86, 112));
+        store_bytes(v + x / 2, chroma_avx2(r, g, b, 112, -102, -10));
+    }
+    return x;
+}
+
+#endif  // HAVE_X86_KERNELS
+
+/**
+ * @brief Converts a frame with a vector routine for the bulk of every pair
+ * of rows and the scalar code for the rest.
+ */
+static inline void convert_frame(RowPairKernel kernel, const uint8_t *src,
+                                 int src_stride, ChannelOrder order, int width,
+                                 int height, uint8_t *dst_y, int y_stride,
+                                 uint8_t *dst_u, int u_stride, uint8_t *dst_v,
+                                 int v_stride) {
+    int row = 0;
+    for (; row + 1 < height; row += 2) {
+        const uint8_t *row0 = src + (size_t)row * src_stride;
+        const uint8_t *row1 = row0 + src_stride;
+        uint8_t *y0 = dst_y + (size_t)row * y_stride;
+        uint8_t *y1 = y0 + y_stride;
+        uint8_t *u = dst_u + (size_t)(row / 2) * u_stride;
+        uint8_t *v = dst_v + (size_t)(row / 2) * v_stride;
+
+        int done = kernel(row0, row1, order, width, y0, y1, u, v);
+        convert_row_pair_scalar(row0, row1, order, done, width, y0, y1, u, v);
+    }
+    if (row < height) {
+        const uint8_t *row0 = src + (size_t)row * src_stride;
+        convert_row_pair_scalar(row0, row0, order, 0, width,
+                                dst_y + (size_t)row * y_stride, nullptr,
+                                dst_u + (size_t)(row / 2) * u_stride,
+                                dst_v + (size_t)(row / 2) * v_stride);
+    }
+}
+
+static void rgb_to_i420_scalar(const uint8_t *src, int src_stride,
+                               ChannelOrder order, int width, int height,
+                               uint8_t *dst_y, int y_stride, uint8_t *dst_u,
+                               int u_stride, uint8_t *dst_v, int v_stride) {
+    convert_frame(convert_row_pair_none, src, src_stride, order, width, height,
+                  dst_y, y_stride, dst_u, u_stride, dst_v, v_stride);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+static void rgb_to_i420_sse41(const uint8_t *src, int src_stride,
+                              ChannelOrder order, int width, int height,
+                              uint8_t *dst_y, int y_stride, uint8_t *dst_u,
+                              int u_stride, uint8_t *dst_v, int v_stride) {
+    convert_frame(convert_row_pair_sse41, src, src_stride, order, width,
+                  height, dst_y, y_stride, dst_u, u_stride, dst_v, v_stride);
+}
+
+static void rgb_to_i420_avx2(const uint8_t *src, int src_stride,
+                             ChannelOrder order, int width, int height,
+                             uint8_t *dst_y, int y_stride, uint8_t *dst_u,
+                             int u_stride, uint8_t *dst_v, int v_stride) {
+    convert_frame(convert_row_pair_avx2, src, src_stride, order, width, height,
+                  dst_y, y_stride, dst_u, u_stride, dst_v, v_stride);
+}
+
+#endif  // HAVE_X86_KERNELS
+
+SimdLevel best_simd_level() {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::Avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return SimdLevel::Sse41;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+const char *simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Avx2:
+            return "avx2";
+        case SimdLevel::Sse41:
+            return "sse4.1";
+        case SimdLevel::Scalar:
+        default:
+            return "scalar";
+    }
+}
+
+RgbToI420Kernel get_rgb_to_i420_kernel(SimdLevel level) {
+    if (level > best_simd_level()) {
+        return nullptr;
+    }
+
+    switch (level) {
+#ifdef HAVE_X86_KERNELS
+        case SimdLevel::Avx2:
+            return rgb_to_i420_avx2;
+        case SimdLevel::Sse41:
+            return rgb_to_i420_sse41;
+#endif
+        case SimdLevel::Scalar:
+        default:
+            return rgb_to_i420_scalar;
+    }
+}
+
+void rgb_to_i420(const uint8_t *src, int src_stride, ChannelOrder order,
+                 int width, int height, uint8_t *dst_y, int y_stride,
+                 uint8_t *dst_u, int u_stride, uint8_t *dst_v, int v_stride) {
+    static const RgbToI420Kernel kernel =
+        get_rgb_to_i420_kernel(best_simd_level());
+    kernel(src, src_stride, order, width, height, dst_y, y_stride, dst_u,
+           u_stride, dst_v, v_stride);
+}
@@ -0,0 +1,357 @@
+#include "encoder.hpp"
+
+#include <fmt/core.h>
+#include <gst/gst.h>
+
+#include <algorithm>
+#include <vector>
+
+// VBV buffer of x264 in strict CBR mode unless one is configured, a few
+// frame intervals at common frame rates
+#define STRICT_CBR_VBV_BUFFER_MS 250
+
+static const EncoderProfile x264_profile = {
+    "x264enc",
+    "h264parse",
+    "config-interval=-1",
+    "video/x-h264,stream-format=byte-stream,alignment=au",
+    "bitrate",
+    1,
+    "key-int-max",
+    true,
+    false,
+};
+
+static const EncoderProfile x265_profile = {
+    "x265enc",
+    "h265parse",
+    "config-interval=-1",
+    "video/x-h265,stream-format=byte-stream,alignment=au",
+    "bitrate",
+    1,
+    "key-int-max",
+    false,
+    false,
+};
+
+static const EncoderProfile openh264_profile = {
+    "openh264enc",
+    "h264parse",
+    "config-interval=-1",
+    "video/x-h264,stream-format=byte-stream,alignment=au",
+    "bitrate",
+    1000,
+    "gop-size",
+    true,
+    false,
+};
+
+static const EncoderProfile vp8_profile = {
+    "vp8enc",
+    nullptr,
+    "",
+    "video/x-vp8",
+    "target-bitrate",
+    1000,
+    "keyframe-max-dist",
+    false,
+    false,
+};
+
+static const EncoderProfile vp9_profile = {
+    "vp9enc",
+    "vp9parse",
+    "",
+    "video/x-vp9",
+    "target-bitrate",
+    1000,
+    "keyframe-max-dist",
+    false,
+    false,
+};
+
+static const EncoderProfile svtav1_profile = {
+    "svtav1enc",
+    "av1parse",
+    "",
+    "video/x-av1",
+    "target-bitrate",
+    1,
+    "intra-period-length",
+    false,
+    false,
+};
+
+static const EncoderProfile rav1e_profile = {
+    "rav1enc",
+    "av1parse",
+    "",
+    "video/x-av1",
+    "bitrate",
+    1000,
+    "max-key-frame-interval",
+    false,
+    false,
+};
+
+// The only profile that honours the ROI meta, through the "roi/vaapi"
+// parameters added by send_frame
+static const EncoderProfile vaapi_h264_profile = {
+    "vaapih264enc",
+    "h264parse",
+    "config-interval=-1",
+    "video/x-h264,stream-format=byte-stream,alignment=au",
+    "bitrate",
+    1,
+    "keyframe-period",
+    true,
+    true,
+};
+
+/**
+ * @brief Formats the x264enc properties that have been set explicitly.
+ */
+static std::string x264_options(const X264Settings &x264) {
+    std::string options;
+    if (x264.threads) {
+        options += fmt::format(" threads={}", *x264.threads);
+    }
+    if (x264.sliced_threads) {
+        options += fmt::format(" sliced-threads={}",
+                               *x264.sliced_threads ? "true" : "false");
+    }
+    if (x264.rc_lookahead) {
+        options += fmt::format(" rc-lookahead={}", *x264.rc_lookahead);
+    }
+    if (x264.sync_lookahead) {
+        options += fmt::format(" sync-lookahead={}", *x264.sync_lookahead);
+    }
+    if (x264.key_int_max) {
+        options += fmt::format(" key-int-max={}", *x264.key_int_max);
+    }
+    if (x264.bframes) {
+        options += fmt::format(" bframes={}", *x264.bframes);
+    }
+    if (x264.vbv_buf_capacity) {
+        options += fmt::format(" vbv-buf-capacity={}", *x264.vbv_buf_capacity);
+    }
+    return options;
+}
+
+/**
+ * @brief Formats the option-string property of x264enc and x265enc from
+ * parameters in the key=value format of the encoder library.
+ */
+static std::string option_string(const std::vector<std::string> &params) {
+    if (params.empty()) {
+        return "";
+    }
+    std::string joined = params[0];
+    for (size_t i = 1; i < params.size(); i++) {
+        joined += ":" + params[i];
+    }
+    return fmt::format(" option-string=\"{}\"", joined);
+}
+
+/**
+ * @brief Adds the x264 and x265 parameters implementing a GOP policy.
+ */
+static void add_gop_params(const GopSettings &gop, uint interval,
+                           std::vector<std::string> &params) {
+    if (interval > 0) {
+        // Scene cuts would insert keyframes between the planned ones
+        params.push_back("scenecut=0");
+        if (!gop.align_to_wall_clock) {
+            params.push_back(fmt::format("min-keyint={}", interval));
+        }
+    }
+    // x265 opens its GOPs by default and x264 does not, so the policy is
+    // always stated explicitly
+    params.push_back(fmt::format("open-gop={}", gop.closed ? 0 : 1));
+}
+
+const EncoderProfile &get_encoder_profile(VideoEncoder encoder) {
+    switch (encoder) {
+        case VideoEncoder::X265:
+            return x265_profile;
+        case VideoEncoder::OpenH264:
+            return openh264_profile;
+        case VideoEncoder::VP8:
+            return vp8_profile;
+        case VideoEncoder::VP9:
+            return vp9_profile;
+        case VideoEncoder::SvtAv1:
+            return svtav1_profile;
+        case VideoEncoder::Rav1e:
+            return rav1e_profile;
+        case VideoEncoder::VaapiH264:
+            return vaapi_h264_profile;
+        case VideoEncoder::X264:
+        default:
+            return x264_profile;
+    }
+}
+
+const char *encoder_name(VideoEncoder encoder) {
+    return get_encoder_profile(encoder).factory;
+}
+
+/**
+ * @brief Checks whether an element factory is registered.
+ */
+static bool has_element_factory(const char *name) {
+    GstElementFactory *factory = gst_element_factory_find(name);
+    if (!factory) {
+        return false;
+    }
+    gst_object_unref(factory);
+    return true;
+}
+
+bool is_encoder_available(VideoEncoder encoder) {
+    const EncoderProfile &profile = get_encoder_profile(encoder);
+    if (!has_element_factory(profile.factory)) {
+        return false;
+    }
+    return !profile.parser || has_element_factory(profile.parser);
+}
+
+uint gop_interval_frames(const GopSettings &gop, int frame_rate) {
+    if (gop.interval_frames > 0) {
+        return gop.interval_frames;
+    }
+    if (gop.interval_ms == 0) {
+        return 0;
+    }
+    return std::max(1u, (uint)((uint64_t)gop.interval_ms * frame_rate / 1000));
+}
+
+uint gop_interval_ms(const GopSettings &gop, int frame_rate) {
+    if (gop.interval_frames > 0) {
+        return (uint)((uint64_t)gop.interval_frames * 1000 / frame_rate);
+    }
+    return gop.interval_ms;
+}
+
+std::string encoder_description(const EncoderSettings &settings,
+                                const char *name, int frame_rate) {
+    const EncoderProfile &profile = get_encoder_profile(settings.backend);
+    uint64_t bitrate =
+        (uint64_t)settings.bitrate_kbps * profile.bitrate_multiplier;
+
+    // Wall clock alignment forces the keyframes itself, the encoder interval
+    // is only kept as a fallback that never fires before the forced ones
+    const GopSettings &gop = settings.gop;
+    bool has_gop = gop.interval_frames > 0 || gop.interval_ms > 0;
+    uint interval = has_gop ? gop_interval_frames(gop, frame_rate) : 0;
+    uint encoder_interval = gop.align_to_wall_clock ? 2 * interval : interval;
+    std::string options;
+    if (has_gop) {
+        options = fmt::format(" {}={}", profile.keyframe_interval_property,
+                              encoder_interval);
+    }
+
+    const RateControlSettings &rate_control = settings.rate_control;
+    uint max_bitrate_kbps = rate_control.max_bitrate_kbps
+                                ? rate_control.max_bitrate_kbps
+                                : settings.bitrate_kbps;
+    std::vector<std::string> params;
+    add_gop_params(gop, interval, params);
+
+    // With low_latency every profile is tuned for real-time encoding without
+    // frame reordering or lookahead, matching the x264 zerolatency tune.
+    // Without it, x264, x265 and rav1e use their default reordering and
+    // lookahead, the other profiles stay tuned for real time.
+    const char *tune = settings.low_latency ? " tune=zerolatency" : "";
+    switch (settings.backend) {
+        case VideoEncoder::X265:
+            if (rate_control.strict_cbr) {
+                // x265 sizes its VBV buffer in kbit instead of time
+                uint buffer_ms = rate_control.vbv_buffer_ms
+                                     ? rate_control.vbv_buffer_ms
+                                     : 1000;
+                params.push_back("strict-cbr=1");
+                params.push_back(
+                    fmt::format("vbv-maxrate={}", max_bitrate_kbps));
+                params.push_back(fmt::format(
+                    "vbv-bufsize={}",
+                    (uint64_t)max_bitrate_kbps * buffer_ms / 1000));
+            }
+            return fmt::format(
+                "x265enc name={}{} speed-preset={} bitrate={}{}{}", name,
+                tune, settings.speed_preset, bitrate, options,
+                option_string(params));
+        case VideoEncoder::OpenH264:
+            if (rate_control.strict_cbr) {
+                options += fmt::format(
+                    " max-bitrate={}",
+                    (uint64_t)max_bitrate_kbps * profile.bitrate_multiplier);
+            }
+            return fmt::format(
+                "openh264enc name={} usage-type=camera complexity=low "
+                "rate-control=bitrate bitrate={}{}",
+                name, bitrate, options);
+        case VideoEncoder::VP8:
+        case VideoEncoder::VP9:
+            // libvpx already runs in CBR mode, strict CBR forbids overshoot
+            if (rate_control.strict_cbr) {
+                options += " overshoot=0";
+            }
+            if (rate_control.vbv_buffer_ms) {
+                options +=
+                    fmt::format(" buffer-size={}", rate_control.vbv_buffer_ms);
+            }
+            return fmt::format(
+                "{} name={} deadline=1 cpu-used=8 end-usage=cbr "
+                "lag-in-frames=0{} target-bitrate={}{}",
+                profile.factory, name,
+                settings.backend == VideoEncoder::VP9 ? " row-mt=true" : "",
+                bitrate, options);
+        case VideoEncoder::SvtAv1:
+            return fmt::format(
+                "svtav1enc name={} preset=12 target-bitrate={}{}", name,
+                bitrate, options);
+        case VideoEncoder::Rav1e:
+            return fmt::format(
+                "rav1enc name={} speed-preset=10 low-latency={} bitrate={}{}",
+                name, settings.low_latency ? "true" : "false", bitrate,
+                options);
+        case VideoEncoder::VaapiH264:
+            // B-frames are off by default, CBR lets set_bitrate steer it
+            return fmt::format(
+                "vaapih264enc name={} rate-control=cbr bitrate={}{}", name,
+                bitrate, options);
+        case VideoEncoder::X264:
+        default: {
+            // The GOP interval in options is set after, and overrides,
+            // x264.key_int_max
+            X264Settings x264 = settings.x264;
+            if (rate_control.vbv_buffer_ms) {
+                x264.vbv_buf_capacity = rate_control.vbv_buffer_ms;
+            }
+            if (rate_control.strict_cbr) {
+                // x264enc already runs pass=cbr with the VBV rate at the
+                // bitrate, kept in step with set_bitrate, but its 600 ms
+                // buffer lets single frames burst far above the link rate.
+                // Strict mode shrinks the buffer and signals a CBR HRD,
+                // which makes x264 pad the stream up to the bitrate.
+                options += " pass=cbr";
+                if (!x264.vbv_buf_capacity) {
+                    x264.vbv_buf_capacity = STRICT_CBR_VBV_BUFFER_MS;
+                }
+                params.push_back("nal-hrd=cbr");
+                if (rate_control.max_bitrate_kbps) {
+                    params.push_back(fmt::format(
+                        "vbv-maxrate={}", rate_control.max_bitrate_kbps));
+                }
+                if (rate_control.filler) {
+                    params.push_back("filler=1");
+                }
+            }
+            return fmt::format(
+                "x264enc name={}{} speed-preset={} bitrate={}{}{}{}", name,
+                tune, settings.speed_preset, bitrate, x264_options(x264),
+                options, option_string(params));
+        }
+    }
+}
@@ -0,0 +1,235 @@
+#include "latency.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#define NAL_TYPE_SEI 6
+#define SEI_USER_DATA_UNREGISTERED 5
+#define UUID_SIZE 16
+#define TIMESTAMP_PAYLOAD_SIZE (UUID_SIZE + 4 * 8)
+
+// Identifies the SEI messages written by the streamer among those written by
+// the encoder itself
+static const uint8_t timestamp_uuid[UUID_SIZE] = {
+    0x5f, 0x1c, 0x8a, 0x3e, 0x92, 0x4b, 0x4d, 0x27,
+    0xb6, 0x0e, 0x71, 0xd4, 0x2a, 0x98, 0xc3, 0x55,
+};
+
+static void append_u64(std::vector<uint8_t> &out, uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out.push_back((uint8_t)(value >> shift));
+    }
+}
+
+static uint64_t read_u64(const uint8_t *data) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | data[i];
+    }
+    return value;
+}
+
+int64_t wall_clock_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+std::vector<uint8_t> build_timestamp_sei(const FrameTimestamps &timestamps) {
+    std::vector<uint8_t> rbsp;
+    rbsp.push_back(SEI_USER_DATA_UNREGISTERED);
+    rbsp.push_back(TIMESTAMP_PAYLOAD_SIZE);
+    rbsp.insert(rbsp.end(), timestamp_uuid, timestamp_uuid + UUID_SIZE);
+    append_u64(rbsp, timestamps.frame_id);
+    append_u64(rbsp, (uint64_t)timestamps.ingest_us);
+    append_u64(rbsp, (uint64_t)timestamps.encoder_input_us);
+    append_u64(rbsp, (uint64_t)timestamps.encoder_output_us);
+    rbsp.push_back(0x80);
+
+    // A decoder must never see a start code inside the NAL unit
+    std::vector<uint8_t> nal = {NAL_TYPE_SEI};
+    int zeros = 0;
+    for (uint8_t byte : rbsp) {
+        if (zeros >= 2 && byte <= 3) {
+            nal.push_back(3);
+            zeros = 0;
+        }
+        nal.push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+    return nal;
+}
+
+/**
+ * @brief Parses the messages of one SEI NAL unit, without its header.
+ */
+static bool parse_sei(const uint8_t *data, size_t size,
+                      FrameTimestamps &timestamps) {
+    std::vector<uint8_t> rbsp;
+    rbsp.reserve(size);
+    int zeros = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (zeros >= 2 && data[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        rbsp.push_back(data[i]);
+        zeros = data[i] == 0 ? zeros + 1 : 0;
+    }
+
+    size_t pos = 0;
+    // The last byte holds the RBSP trailing bits
+    while (pos + 1 < rbsp.size()) {
+        size_t type = 0, payload_size = 0;
+        while (pos < rbsp.size() && rbsp[pos] == 0xff) {
+            type += 0xff;
+            pos++;
+        }
+        if (pos >= rbsp.size()) {
+            return false;
+        }
+        type += rbsp[pos++];
+        while (pos < rbsp.size() && rbsp[pos] == 0xff) {
+            payload_size += 0xff;
+            pos++;
+        }
+        if (pos >= rbsp.size()) {
+            return false;
+        }
+        payload_size += rbsp[pos++];
+        if (pos + payload_size > rbsp.size()) {
+            return false;
+        }
+
+        const uint8_t *payload = rbsp.data() + pos;
+        if (type == SEI_USER_DATA_UNREGISTERED &&
+            payload_size >= TIMESTAMP_PAYLOAD_SIZE &&
+            memcmp(payload, timestamp_uuid, UUID_SIZE) == 0) {
+            payload += UUID_SIZE;
+            timestamps.frame_id = read_u64(payload);
+            timestamps.ingest_us = (int64_t)read_u64(payload + 8);
+            timestamps.encoder_input_us = (int64_t)read_u64(payload + 16);
+            timestamps.encoder_output_us = (int64_t)read_u64(payload + 24);
+            return true;
+        }
+        pos += payload_size;
+    }
+    return false;
+}
+
+bool find_timestamp_sei(const uint8_t *data, size_t size,
+                        size_t nal_length_size,
+                        FrameTimestamps &timestamps) {
+    size_t pos = 0;
+    while (pos < size) {
+        size_t nal_begin, nal_end;
+        if (nal_length_size > 0) {
+            if (pos + nal_length_size > size) {
+                return false;
+            }
+            size_t length = 0;
+            for (size_t i = 0; i < nal_length_size; i++) {
+                length = length << 8 | data[pos + i];
+            }
+            nal_begin = pos + nal_length_size;
+            nal_end = std::min(size, nal_begin + length);
+            pos = nal_end;
+        } else {
+            // Skip to the byte after the next start code
+            while (pos + 2 < size &&
+                   !(data[pos] == 0 && data[pos + 1] == 0 &&
+                     data[pos + 2] == 1)) {
+                pos++;
+            }
+            if (pos + 2 >= size) {
+                return false;
+            }
+            nal_begin = pos + 3;
+            nal_end = nal_begin;
+            while (nal_end + 2 < size &&
+                   !(data[nal_end] == 0 && data[nal_end + 1] == 0 &&
+                     data[nal_end + 2] <= 1)) {
+                nal_end++;
+            }
+            if (nal_end + 2 >= size) {
+                nal_end = size;
+            }
+            pos = nal_end;
+        }
+
+        if (nal_end > nal_begin && (data[nal_begin] & 0x1f) == NAL_TYPE_SEI &&
+            parse_sei(data + nal_begin + 1, nal_end - nal_begin - 1,
+                      timestamps)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LatencyRecorder::add(const FrameTimestamps &timestamps,
+                          int64_t arrival_us) {
+    frames.push_back(timestamps);
+    arrivals_us.push_back(arrival_us);
+}
+
+bool LatencyRecorder::add(const uint8_t *data, size_t size,
+                          size_t nal_length_size, int64_t arrival_us) {
+    FrameTimestamps timestamps;
+    if (!find_timestamp_sei(data, size, nal_length_size, timestamps)) {
+        return false;
+    }
+    add(timestamps, arrival_us);
+    return true;
+}
+
+static LatencyPercentiles percentiles(std::vector<double> &values) {
+    LatencyPercentiles result;
+    if (values.empty()) {
+        return result;
+    }
+    std::sort(values.begin(), values.end());
+    auto at = [&values](double fraction) {
+        return values[std::min(values.size() - 1,
+                               (size_t)(fraction * (values.size() - 1) + 0.5))];
+    };
+    result.p50_ms = at(0.5);
+    result.p99_ms = at(0.99);
+    result.p999_ms = at(0.999);
+    result.max_ms = values.back();
+    return result;
+}
+
+LatencyReport LatencyRecorder::report() const {
+    LatencyReport report;
+    report.frames = frames.size();
+
+    std::vector<double> pre_encode, encode, delivery, end_to_end;
+    for (size_t i = 0; i < frames.size(); i++) {
+        const FrameTimestamps &frame = frames[i];
+        pre_encode.push_back((frame.encoder_input_us - frame.ingest_us) /
+                             1000.0);
+        encode.push_back((frame.encoder_output_us - frame.encoder_input_us) /
+                         1000.0);
+        delivery.push_back((arrivals_us[i] - frame.encoder_output_us) /
+                           1000.0);
+        end_to_end.push_back((arrivals_us[i] - frame.ingest_us) / 1000.0);
+
+        // Replayed frames after a reconnect go back in the sequence
+        if (i > 0 && frame.frame_id > frames[i - 1].frame_id + 1) {
+            report.missing_frames +=
+                frame.frame_id - frames[i - 1].frame_id - 1;
+        }
+    }
+
+    report.pre_encode = percentiles(pre_encode);
+    report.encode = percentiles(encode);
+    report.delivery = percentiles(delivery);
+    report.end_to_end = percentiles(end_to_end);
+    return report;
+}
+
+void LatencyRecorder::clear() {
+    frames.clear();
+    arrivals_us.clear();
+}
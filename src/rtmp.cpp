@@ -1,7 +1,13 @@
 #include "rtmp.hpp"
 
 #include <fmt/core.h>
+#include <gst/video/video.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <mutex>
 #include <opencv2/imgproc.hpp>
@@ -11,13 +17,36 @@
 #include "gst/gstobject.h"
 
 #define RGB_BYTES 3
+#define MONITOR_INTERVAL_MS 500
+#define MAX_FRAMES_IN_ENCODER 256
+#define ARCHIVE_EOS_TIMEOUT_MS 10000
+
+// Limits of the RTMP queue, the defaults of the queue element
+#define RTMP_QUEUE_MAX_BUFFERS 200
+#define RTMP_QUEUE_MAX_BYTES (10 * 1024 * 1024)
+#define RTMP_QUEUE_MAX_TIME GST_SECOND
+
+// Speed presets of x264 and x265, from the fastest to the slowest
+static const char *speed_presets[] = {"ultrafast", "superfast", "veryfast",
+                                      "faster",    "fast",      "medium",
+                                      "slow",      "slower",    "veryslow"};
+
 std::mutex RtmpStreamer::want_data_muxex = std::mutex();
 std::mutex RtmpStreamer::handling_pipeline = std::mutex();
 
+/**
+ * @brief Formats the threading properties of videoconvert and videoscale.
+ */
+static std::string convert_thread_options(const StreamerConfig &config) {
+    return fmt::format("n-threads={} ", config.convert_threads);
+}
+
 RtmpStreamer::RtmpStreamer()
     : screen_width(1024),
       screen_height(1024),
       want_data(false),
+      rtmp_standby(false),
+      stream_paused(false),
       connected_bins_to_source(0),
       appsrc_need_data_id(0),
       appsrc_enough_data_id(0),
@@ -27,9 +56,17 @@ RtmpStreamer::RtmpStreamer()
 
 RtmpStreamer::RtmpStreamer(uint width, uint height,
                            const char *rtmp_streaming_addr)
-    : screen_width(width),
+    : RtmpStreamer(width, height, rtmp_streaming_addr, StreamerConfig()) {}
+
+RtmpStreamer::RtmpStreamer(uint width, uint height,
+                           const char *rtmp_streaming_addr,
+                           const StreamerConfig &config)
+    : config(config),
+      screen_width(width),
       screen_height(height),
       want_data(false),
+      rtmp_standby(false),
+      stream_paused(false),
       connected_bins_to_source(0),
       appsrc_need_data_id(0),
       appsrc_enough_data_id(0),
@@ -38,7 +75,23 @@ RtmpStreamer::RtmpStreamer(uint width, uint height,
 }
 
 RtmpStreamer::~RtmpStreamer() {
+    {
+        std::lock_guard<std::mutex> guard(monitor_mutex);
+        monitor_running = false;
+    }
+    monitor_cv.notify_all();
+    if (monitor_thread.joinable()) {
+        monitor_thread.join();
+    }
+
     gst_element_set_state(pipeline, GST_STATE_NULL);
+    if (ingest_pool) {
+        gst_buffer_pool_set_active(ingest_pool, FALSE);
+        gst_object_unref(ingest_pool);
+        ingest_pool = nullptr;
+    }
+    gst_bus_set_sync_handler(bus, nullptr, nullptr, nullptr);
+    gst_object_unref(bus);
     gst_object_unref(pipeline);
     if (rtmp_bin) {
         gst_object_unref(rtmp_bin);
@@ -48,6 +101,28 @@ RtmpStreamer::~RtmpStreamer() {
         gst_object_unref(local_video_bin);
         local_video_bin = nullptr;
     }
+    gst_object_unref(rtmp_bin_ref);
+    gst_object_unref(local_video_bin_ref);
+    if (analytics_bin) {
+        gst_object_unref(analytics_bin);
+        analytics_bin = nullptr;
+    }
+    if (archive_bin) {
+        gst_object_unref(archive_bin);
+        archive_bin = nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> guard(replay_mutex);
+        clear_replay_packets();
+    }
+    if (ingest_meta_caps) {
+        gst_caps_unref(ingest_meta_caps);
+        ingest_meta_caps = nullptr;
+    }
+    if (snapshot_buffer) {
+        gst_buffer_unref(snapshot_buffer);
+        snapshot_buffer = nullptr;
+    }
     if (local_video_bin_name) {
         g_free(local_video_bin_name);
         local_video_bin_name = nullptr;
@@ -63,6 +138,9 @@ RtmpStreamer::~RtmpStreamer() {
 }
 
 void RtmpStreamer::start_stream() {
+    if (stream_paused) {
+        resume_stream();
+    }
     connect_appsrc_signal_handler();
     start_rtmp_stream();
     start_local_stream();
@@ -74,13 +152,398 @@ void RtmpStreamer::stop_stream() {
     stop_local_stream();
 }
 
+void RtmpStreamer::pause_stream() {
+    if (connected_bins_to_source == 0) {
+        gst_print("no stream to pause\n");
+        return;
+    }
+    if (stream_paused) {
+        gst_print("stream already paused\n");
+        return;
+    }
+
+    // Stop accepting frames before the pipeline stops consuming them, so
+    // send_frame never blocks on a paused appsrc
+    {
+        std::lock_guard<std::mutex> guard(handling_pipeline);
+        stream_paused = true;
+    }
+    set_pipeline_state(GST_STATE_PAUSED);
+}
+
+void RtmpStreamer::resume_stream() {
+    if (!stream_paused) {
+        gst_print("stream is not paused\n");
+        return;
+    }
+
+    set_pipeline_state(GST_STATE_PLAYING);
+    {
+        std::lock_guard<std::mutex> guard(handling_pipeline);
+        stream_paused = false;
+    }
+    request_keyframe();
+}
+
+bool RtmpStreamer::set_input_resolution(uint width, uint height,
+                                        bool keep_output_resolution) {
+    if (width == 0 || height == 0) {
+        gst_printerr("resolution must be larger than 0x0\n");
+        return false;
+    }
+
+    GstElement *output_caps_filter =
+        gst_bin_get_by_name(GST_BIN(source_bin), "output_caps");
+    if (!output_caps_filter) {
+        gst_printerr("unable to find output capsfilter\n");
+        return false;
+    }
+
+    {
+        // No frame of the old size may be pushed after the caps change
+        std::lock_guard<std::mutex> guard(handling_pipeline);
+
+        GstCaps *previous_caps = gst_app_src_get_caps(GST_APP_SRC(appsrc));
+        GstCaps *input_caps = gst_caps_copy(previous_caps);
+        gst_caps_set_simple(input_caps, "width", G_TYPE_INT, (gint)width,
+                            "height", G_TYPE_INT, (gint)height, nullptr);
+        gst_app_src_set_caps(GST_APP_SRC(appsrc), input_caps);
+        gst_caps_unref(input_caps);
+
+        uint previous_width = screen_width;
+        uint previous_height = screen_height;
+        screen_width = width;
+        screen_height = height;
+        if (ingest_pool && !configure_ingest_pool()) {
+            // Frames of the old size are still accepted after a failure
+            gst_app_src_set_caps(GST_APP_SRC(appsrc), previous_caps);
+            gst_caps_unref(previous_caps);
+            screen_width = previous_width;
+            screen_height = previous_height;
+            if (!configure_ingest_pool()) {
+                gst_printerr("unable to restore the ingest buffer pool\n");
+            }
+            gst_object_unref(output_caps_filter);
+            return false;
+        }
+        gst_caps_unref(previous_caps);
+        if (!keep_output_resolution) {
+            output_width = width;
+            output_height = height;
+        }
+
+        // Pinning the size in the output caps makes videoscale convert every
+        // input size to it, leaving it open lets the output follow the input
+        GstCaps *caps;
+        g_object_get(output_caps_filter, "caps", &caps, nullptr);
+        GstCaps *output_caps = gst_caps_copy(caps);
+        gst_caps_unref(caps);
+        if (keep_output_resolution) {
+            gst_caps_set_simple(output_caps, "width", G_TYPE_INT,
+                                (gint)output_width, "height", G_TYPE_INT,
+                                (gint)output_height, nullptr);
+        } else {
+            gst_structure_remove_fields(gst_caps_get_structure(output_caps, 0),
+                                        "width", "height", nullptr);
+        }
+        g_object_set(output_caps_filter, "caps", output_caps, nullptr);
+        gst_caps_unref(output_caps);
+    }
+    gst_object_unref(output_caps_filter);
+
+    {
+        // Keep a lowered RTMP resolution relative to the new output size
+        std::lock_guard<std::mutex> guard(monitor_mutex);
+        set_rtmp_output_scale(rtmp_output_scale);
+    }
+
+    request_keyframe();
+    return true;
+}
+
+bool RtmpStreamer::set_input_frame_rate(int frame_rate) {
+    if (frame_rate <= 0) {
+        gst_printerr("frame rate must be larger than 0\n");
+        return false;
+    }
+
+    // Buffer durations are derived from the input rate in send_frame
+    std::lock_guard<std::mutex> guard(handling_pipeline);
+
+    GstCaps *caps = gst_app_src_get_caps(GST_APP_SRC(appsrc));
+    GstCaps *input_caps = gst_caps_copy(caps);
+    gst_caps_unref(caps);
+    gst_caps_set_simple(input_caps, "framerate", GST_TYPE_FRACTION, frame_rate,
+                        1, nullptr);
+    gst_app_src_set_caps(GST_APP_SRC(appsrc), input_caps);
+    gst_caps_unref(input_caps);
+
+    frame_rate_in = frame_rate;
+    return true;
+}
+
+bool RtmpStreamer::set_output_frame_rate(int frame_rate) {
+    if (frame_rate <= 0) {
+        gst_printerr("frame rate must be larger than 0\n");
+        return false;
+    }
+
+    // A GOP given in time has to be converted into frames at the new rate,
+    // which most encoders only accept before they are started
+    const GopSettings &gop = config.encoder.gop;
+    const EncoderProfile &profile = get_encoder_profile(config.encoder.backend);
+    GstElement *encoder = nullptr;
+    if (gop.interval_frames == 0 && gop.interval_ms > 0) {
+        encoder = get_element_by_name("video_encoder");
+    }
+    if (encoder) {
+        GParamSpec *spec = g_object_class_find_property(
+            G_OBJECT_GET_CLASS(encoder), profile.keyframe_interval_property);
+        bool writable = spec && (GST_STATE(encoder) <= GST_STATE_READY ||
+                                 (spec->flags & GST_PARAM_MUTABLE_PLAYING));
+        if (!writable) {
+            gst_printerr("%s can not change its keyframe interval while "
+                         "playing\n", profile.factory);
+            gst_object_unref(encoder);
+            return false;
+        }
+    }
+
+    GstElement *output_caps_filter =
+        gst_bin_get_by_name(GST_BIN(source_bin), "output_caps");
+    if (!output_caps_filter) {
+        gst_printerr("unable to find output capsfilter\n");
+        if (encoder) {
+            gst_object_unref(encoder);
+        }
+        return false;
+    }
+
+    // The new caps are negotiated on the next frame, the encoder reconfigures
+    // itself for the new rate and starts with a keyframe
+    GstCaps *caps;
+    g_object_get(output_caps_filter, "caps", &caps, nullptr);
+    GstCaps *output_caps = gst_caps_copy(caps);
+    gst_caps_unref(caps);
+    gst_caps_set_simple(output_caps, "framerate", GST_TYPE_FRACTION,
+                        frame_rate, 1, nullptr);
+    g_object_set(output_caps_filter, "caps", output_caps, nullptr);
+    gst_caps_unref(output_caps);
+    gst_object_unref(output_caps_filter);
+
+    frame_rate_out = frame_rate;
+
+    // Keep the GOP duration when it is given in time, or the aligned
+    // duration when it is given in frames
+    if (gop.align_to_wall_clock && gop_align_interval_ms) {
+        gop_align_interval_ms = gop_interval_ms(gop, frame_rate);
+    }
+    if (encoder) {
+        uint interval = gop_interval_frames(gop, frame_rate);
+        if (gop.align_to_wall_clock) {
+            interval *= 2;
+        }
+        GValue value = G_VALUE_INIT;
+        g_value_init(&value, G_TYPE_UINT64);
+        g_value_set_uint64(&value, interval);
+        g_object_set_property(G_OBJECT(encoder),
+                              profile.keyframe_interval_property, &value);
+        g_value_unset(&value);
+        gst_object_unref(encoder);
+    }
+    return true;
+}
+
+bool RtmpStreamer::set_bitrate(uint kbps) {
+    // The adaptive bitrate controller reads and steps the same target
+    std::lock_guard<std::mutex> guard(monitor_mutex);
+    return apply_bitrate(kbps);
+}
+
+bool RtmpStreamer::apply_bitrate(uint kbps) {
+    if (kbps == 0) {
+        gst_printerr("bitrate must be larger than 0\n");
+        return false;
+    }
+
+    GstElement *encoder = get_element_by_name("video_encoder");
+    if (!encoder) {
+        gst_printerr("unable to find encoder\n");
+        return false;
+    }
+
+    const EncoderProfile &profile = get_encoder_profile(config.encoder.backend);
+    GParamSpec *spec = g_object_class_find_property(
+        G_OBJECT_GET_CLASS(encoder), profile.bitrate_property);
+    if (!spec) {
+        gst_printerr("%s has no property %s\n", profile.factory,
+                     profile.bitrate_property);
+        gst_object_unref(encoder);
+        return false;
+    }
+
+    // The value is transformed into the type of the encoder property, which
+    // differs between encoders. GObject would only warn about a value outside
+    // its range and keep the old one, and a value that does not fit the type
+    // does not survive the transformation back.
+    guint64 bitrate = (guint64)kbps * profile.bitrate_multiplier;
+    GValue requested = G_VALUE_INIT;
+    GValue value = G_VALUE_INIT;
+    GValue transformed = G_VALUE_INIT;
+    g_value_init(&requested, G_TYPE_UINT64);
+    g_value_init(&value, G_PARAM_SPEC_VALUE_TYPE(spec));
+    g_value_init(&transformed, G_TYPE_UINT64);
+    g_value_set_uint64(&requested, bitrate);
+    bool valid = g_value_transform(&requested, &value) &&
+                 g_value_transform(&value, &transformed) &&
+                 g_value_get_uint64(&transformed) == bitrate &&
+                 !g_param_value_validate(spec, &value);
+    if (valid) {
+        g_object_set_property(G_OBJECT(encoder), profile.bitrate_property,
+                              &value);
+    } else {
+        gst_printerr("bitrate of %u kbit/s is out of range for %s\n", kbps,
+                     profile.factory);
+    }
+    g_value_unset(&requested);
+    g_value_unset(&value);
+    g_value_unset(&transformed);
+    gst_object_unref(encoder);
+    if (!valid) {
+        return false;
+    }
+
+    config.encoder.bitrate_kbps = kbps;
+    std::lock_guard<std::mutex> guard(metrics_mutex);
+    metrics.target_bitrate_kbps = kbps;
+    return true;
+}
+
+void RtmpStreamer::enable_adaptive_bitrate(
+    const AdaptiveBitrateConfig &abr_config) {
+    std::lock_guard<std::mutex> guard(monitor_mutex);
+    adaptive_bitrate_config = abr_config;
+    if (adaptive_bitrate_config.max_bitrate_kbps == 0) {
+        adaptive_bitrate_config.max_bitrate_kbps = config.encoder.bitrate_kbps;
+    }
+    adaptive_bitrate_healthy_intervals = 0;
+    adaptive_bitrate_last_step = std::chrono::steady_clock::now();
+    adaptive_bitrate_enabled = true;
+}
+
+void RtmpStreamer::disable_adaptive_bitrate() {
+    std::lock_guard<std::mutex> guard(monitor_mutex);
+    adaptive_bitrate_enabled = false;
+}
+
+void RtmpStreamer::set_encoded_packet_callback(
+    EncodedPacketCallback callback) {
+    bool enabled = static_cast<bool>(callback);
+    {
+        std::lock_guard<std::mutex> guard(encoded_packet_mutex);
+        encoded_packet_callback = std::move(callback);
+    }
+
+    GstElement *valve = get_element_by_name("encoded_valve");
+    if (!valve) {
+        gst_printerr("unable to find encoded packet valve\n");
+        return;
+    }
+    g_object_set(valve, "drop", (gboolean)!enabled, nullptr);
+    gst_object_unref(valve);
+
+    // Let the new consumer start on a decodable frame
+    if (enabled) {
+        request_keyframe();
+    }
+}
+
+bool RtmpStreamer::set_overlay_text(const std::string &text) {
+    GstElement *overlay =
+        gst_bin_get_by_name(GST_BIN(source_bin), "text_overlay");
+    if (!overlay) {
+        gst_printerr("text overlay is not enabled\n");
+        return false;
+    }
+    g_object_set(overlay, "text", text.c_str(), nullptr);
+    gst_object_unref(overlay);
+    return true;
+}
+
+std::vector<uint8_t> RtmpStreamer::snapshot() {
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(source_bin), "snapshot_sink");
+    if (!sink) {
+        gst_printerr("unable to find snapshot sink\n");
+        return {};
+    }
+
+    GstSample *sample = nullptr;
+    g_object_get(sink, "last-sample", &sample, nullptr);
+    gst_object_unref(sink);
+    if (!sample) {
+        return {};
+    }
+
+    std::lock_guard<std::mutex> guard(snapshot_mutex);
+
+    // The cache holds a reference to its frame, so the pointer can not be
+    // reused by a newer buffer while it is cached
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if (buffer && buffer == snapshot_buffer) {
+        gst_sample_unref(sample);
+        return snapshot_jpeg;
+    }
+
+    GstCaps *jpeg_caps = gst_caps_new_empty_simple("image/jpeg");
+    GError *err = nullptr;
+    GstSample *jpeg_sample =
+        gst_video_convert_sample(sample, jpeg_caps, GST_SECOND, &err);
+    gst_caps_unref(jpeg_caps);
+
+    if (!jpeg_sample) {
+        gst_printerr("unable to encode snapshot: %s\n",
+                     err ? err->message : "unknown error");
+        g_clear_error(&err);
+        gst_sample_unref(sample);
+        return {};
+    }
+
+    GstMapInfo map;
+    GstBuffer *jpeg_buffer = gst_sample_get_buffer(jpeg_sample);
+    if (jpeg_buffer && gst_buffer_map(jpeg_buffer, &map, GST_MAP_READ)) {
+        snapshot_jpeg.assign(map.data, map.data + map.size);
+        gst_buffer_unmap(jpeg_buffer, &map);
+
+        if (snapshot_buffer) {
+            gst_buffer_unref(snapshot_buffer);
+        }
+        snapshot_buffer = gst_buffer_ref(buffer);
+    }
+
+    gst_sample_unref(jpeg_sample);
+    gst_sample_unref(sample);
+    return snapshot_jpeg;
+}
+
+StreamerMetrics RtmpStreamer::get_metrics() const {
+    std::lock_guard<std::mutex> guard(metrics_mutex);
+    return metrics;
+}
+
 void RtmpStreamer::start_rtmp_stream() {
     GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), rtmp_bin_name);
     if (bin) {
-        gst_print("rtmp bin already connected\n");
         g_object_unref(bin);
+        if (rtmp_standby) {
+            resume_rtmp_stream();
+            return;
+        }
+        gst_print("rtmp bin already connected\n");
         return;
     }
+    if (stream_paused) {
+        resume_stream();
+    }
     connect_appsrc_signal_handler();
 
     if (!connect_sink_bin_to_source_bin(source_bin, &rtmp_bin, &src_rtmp_tee_pad,
@@ -89,8 +552,7 @@ void RtmpStreamer::start_rtmp_stream() {
     }
 
     if (++connected_bins_to_source == 1) {
-        gst_element_set_state(pipeline, GST_STATE_PLAYING);
-        bus = gst_element_get_bus(pipeline);
+        set_pipeline_state(GST_STATE_PLAYING);
     }
 }
 
@@ -102,10 +564,16 @@ void RtmpStreamer::stop_rtmp_stream() {
     }
     g_object_unref(bin);
     if (--connected_bins_to_source == 0) {
-        gst_element_set_state(pipeline, GST_STATE_NULL);
+        set_pipeline_state(GST_STATE_NULL);
         disconnect_appsrc_signal_handler();
-        gst_object_unref(bus);
-        bus = nullptr;
+        stream_paused = false;
+
+        // Stream time starts over with the next start, stale samples would
+        // stay in the window and inflate the peak. The encoder thread is
+        // stopped in NULL, so the window can be cleared here.
+        bitrate_window.clear();
+        bitrate_window_bytes = 0;
+        peak_window_bytes = 0;
     }
 
     if (!disconnect_sink_bin_from_source_bin(
@@ -113,6 +581,260 @@ void RtmpStreamer::stop_rtmp_stream() {
         exit(1);
     }
     src_rtmp_tee_pad = nullptr;
+
+    // A stopped stream always starts again with an open valve
+    set_rtmp_valve_drop(false);
+    rtmp_standby = false;
+
+    std::lock_guard<std::mutex> guard(monitor_mutex);
+    reset_reconnect();
+}
+
+void RtmpStreamer::start_analytics_stream(uint width, uint height,
+                                          int frame_rate,
+                                          RawFrameCallback callback) {
+    GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), "analytics_bin");
+    if (bin) {
+        gst_print("analytics bin already connected\n");
+        g_object_unref(bin);
+        return;
+    }
+    if (stream_paused) {
+        resume_stream();
+    }
+    connect_appsrc_signal_handler();
+
+    // Rate reduction runs first so dropped frames are never scaled
+    auto analytics_format_string = fmt::format(
+        "queue name=analytics_queue leaky=downstream max-size-buffers=1 "
+        "! videorate name=analytics_rate drop-only=true "
+        "! videoscale name=analytics_scale {0}"
+        "! videoconvert name=analytics_convert {0}"
+        "! video/x-raw,format=BGR,width={1},height={2},framerate={3}/1 "
+        "! appsink name=analytics_sink sync=false max-buffers=1 drop=true",
+        convert_thread_options(config), width, height, frame_rate);
+
+    analytics_bin = gst_parse_bin_from_description(
+        analytics_format_string.c_str(), true, nullptr);
+    if (!analytics_bin) {
+        gst_printerr("Error setting up analytics bin.\n");
+        return;
+    }
+    gst_element_set_name(analytics_bin, "analytics_bin");
+
+    GstElement *sink =
+        gst_bin_get_by_name(GST_BIN(analytics_bin), "analytics_sink");
+    GstAppSinkCallbacks analytics_sink_callbacks = {};
+    analytics_sink_callbacks.new_sample = cb_new_analytics_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &analytics_sink_callbacks,
+                               this, nullptr);
+    gst_object_unref(sink);
+
+    {
+        std::lock_guard<std::mutex> guard(analytics_mutex);
+        analytics_callback = std::move(callback);
+    }
+
+    if (!connect_sink_bin_to_source_bin(source_bin, &analytics_bin,
+                                        &src_analytics_tee_pad, "tee",
+                                        "analytics_src")) {
+        exit(1);
+    }
+
+    if (++connected_bins_to_source == 1) {
+        set_pipeline_state(GST_STATE_PLAYING);
+    }
+}
+
+bool RtmpStreamer::start_archive(const ArchiveConfig &archive_config) {
+    GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), "archive_bin");
+    if (bin || archive_bin) {
+        gst_print("archive bin already connected\n");
+        if (bin) {
+            g_object_unref(bin);
+        }
+        return false;
+    }
+
+    const EncoderProfile &profile =
+        get_encoder_profile(archive_config.encoder.backend);
+    if (!is_encoder_available(archive_config.encoder.backend)) {
+        gst_printerr("encoder %s or its parser is not installed\n",
+                     profile.factory);
+        return false;
+    }
+
+    if (stream_paused) {
+        resume_stream();
+    }
+    connect_appsrc_signal_handler();
+
+    std::string parse_string;
+    if (profile.parser) {
+        parse_string = fmt::format("! {} name=archive_parse {} ",
+                                   profile.parser, profile.parser_options);
+    }
+
+    // The queue never blocks the tee, so the live branches keep their
+    // latency when the archive encoder falls behind
+    auto archive_format_string = fmt::format(
+        "queue name=archive_queue leaky=downstream max-size-buffers=0 "
+        "max-size-bytes=0 max-size-time={} "
+        "! videoconvert name=archive_convert {}"
+        "! {} {}! matroskamux name=archive_mux "
+        "! filesink name=archive_sink location=\"{}\" sync=false async=false",
+        (guint64)archive_config.queue_time_ms * GST_MSECOND,
+        convert_thread_options(config),
+        encoder_description(archive_config.encoder, "archive_encoder",
+                            frame_rate_out),
+        parse_string, archive_config.location);
+
+    archive_bin = gst_parse_bin_from_description(
+        archive_format_string.c_str(), true, nullptr);
+    if (!archive_bin) {
+        gst_printerr("Error setting up archive bin.\n");
+        return false;
+    }
+    gst_element_set_name(archive_bin, "archive_bin");
+
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(archive_bin), "archive_sink");
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      cb_archive_eos, this, nullptr);
+    gst_object_unref(sink_pad);
+    gst_object_unref(sink);
+
+    {
+        std::lock_guard<std::mutex> guard(archive_mutex);
+        archive_eos = false;
+    }
+    archive_niceness = archive_config.niceness;
+
+    if (!connect_sink_bin_to_source_bin(source_bin, &archive_bin,
+                                        &src_archive_tee_pad, "tee",
+                                        "archive_src")) {
+        exit(1);
+    }
+
+    if (++connected_bins_to_source == 1) {
+        set_pipeline_state(GST_STATE_PLAYING);
+    }
+    return true;
+}
+
+void RtmpStreamer::stop_archive() {
+    GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), "archive_bin");
+    if (!bin) {
+        gst_print("archive bin already disconnected\n");
+        return;
+    }
+    g_object_unref(bin);
+
+    if (!disconnect_sink_bin_from_source_bin(source_bin, &archive_bin,
+                                             src_archive_tee_pad,
+                                             "archive_bin", "archive_src")) {
+        exit(1);
+    }
+    src_archive_tee_pad = nullptr;
+
+    // The detached bin keeps running until EOS has drained the queue and
+    // the muxer has written the index of the file
+    GstPad *archive_sink_pad = gst_element_get_static_pad(archive_bin, "sink");
+    gst_pad_send_event(archive_sink_pad, gst_event_new_eos());
+    gst_object_unref(archive_sink_pad);
+    {
+        std::unique_lock<std::mutex> lock(archive_mutex);
+        if (!archive_cv.wait_for(
+                lock, std::chrono::milliseconds(ARCHIVE_EOS_TIMEOUT_MS),
+                [this] { return archive_eos; })) {
+            gst_printerr("archive was not finalized in time\n");
+        }
+    }
+
+    gst_element_set_state(archive_bin, GST_STATE_NULL);
+    gst_object_unref(archive_bin);
+    archive_bin = nullptr;
+
+    if (--connected_bins_to_source == 0) {
+        set_pipeline_state(GST_STATE_NULL);
+        disconnect_appsrc_signal_handler();
+        stream_paused = false;
+    }
+}
+
+void RtmpStreamer::stop_analytics_stream() {
+    GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), "analytics_bin");
+    if (!bin) {
+        gst_print("analytics bin already disconnected\n");
+        return;
+    }
+    g_object_unref(bin);
+    if (--connected_bins_to_source == 0) {
+        set_pipeline_state(GST_STATE_NULL);
+        disconnect_appsrc_signal_handler();
+        stream_paused = false;
+    }
+
+    if (!disconnect_sink_bin_from_source_bin(source_bin, &analytics_bin,
+                                             src_analytics_tee_pad,
+                                             "analytics_bin", "analytics_src")) {
+        exit(1);
+    }
+    src_analytics_tee_pad = nullptr;
+
+    // The bin is rebuilt on the next start, so release it completely
+    gst_element_set_state(analytics_bin, GST_STATE_NULL);
+    gst_object_unref(analytics_bin);
+    analytics_bin = nullptr;
+
+    std::lock_guard<std::mutex> guard(analytics_mutex);
+    analytics_callback = nullptr;
+}
+
+void RtmpStreamer::standby_rtmp_stream() {
+    if (!set_rtmp_valve_drop(true)) {
+        gst_printerr("unable to put rtmp stream in standby\n");
+        return;
+    }
+    rtmp_standby = true;
+
+    GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), rtmp_bin_name);
+    if (bin) {
+        g_object_unref(bin);
+        return;
+    }
+    start_rtmp_stream();
+}
+
+void RtmpStreamer::resume_rtmp_stream() {
+    GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), rtmp_bin_name);
+    if (!bin) {
+        start_rtmp_stream();
+        return;
+    }
+    g_object_unref(bin);
+
+    if (!rtmp_standby) {
+        gst_print("rtmp stream is not in standby\n");
+        return;
+    }
+
+    GstElement *valve = get_element_by_name("rtmp_valve");
+    if (!valve) {
+        gst_printerr("unable to find rtmp valve\n");
+        return;
+    }
+
+    // Hold back delta frames until the forced keyframe reaches the valve
+    GstPad *valve_src_pad = gst_element_get_static_pad(valve, "src");
+    gst_pad_add_probe(valve_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      cb_drop_until_keyframe, nullptr, nullptr);
+    gst_object_unref(valve_src_pad);
+    gst_object_unref(valve);
+
+    request_keyframe();
+    set_rtmp_valve_drop(false);
+    rtmp_standby = false;
 }
 
 void RtmpStreamer::start_local_stream() {
@@ -123,6 +845,9 @@ void RtmpStreamer::start_local_stream() {
         g_object_unref(bin);
         return;
     }
+    if (stream_paused) {
+        resume_stream();
+    }
     connect_appsrc_signal_handler();
 
     if (!connect_sink_bin_to_source_bin(source_bin, &local_video_bin,
@@ -132,8 +857,7 @@ void RtmpStreamer::start_local_stream() {
     }
 
     if (++connected_bins_to_source == 1) {
-        gst_element_set_state(pipeline, GST_STATE_PLAYING);
-        bus = gst_element_get_bus(pipeline);
+        set_pipeline_state(GST_STATE_PLAYING);
     }
 }
 
@@ -147,10 +871,9 @@ void RtmpStreamer::stop_local_stream() {
     g_object_unref(bin);
     connected_bins_to_source -= 1;
     if (connected_bins_to_source == 0) {
-        gst_element_set_state(pipeline, GST_STATE_NULL);
+        set_pipeline_state(GST_STATE_NULL);
         disconnect_appsrc_signal_handler();
-        gst_object_unref(bus);
-        bus = nullptr;
+        stream_paused = false;
     }
 
     if (!disconnect_sink_bin_from_source_bin(source_bin, &local_video_bin,
@@ -161,13 +884,17 @@ void RtmpStreamer::stop_local_stream() {
     }
 }
 
-bool RtmpStreamer::send_frame(unsigned char *frame, size_t size) {
+bool RtmpStreamer::send_frame(unsigned char *frame, size_t size,
+                              const std::vector<RegionOfInterest> &regions) {
     if (size <= 0) {
         gst_printerr("Captured frame is empty.\n");
         return FALSE;
     }
 
     std::lock_guard<std::mutex> guard(handling_pipeline);
+    if (stream_paused) {
+        return FALSE;
+    }
 
     want_data_muxex.lock();
     if (!want_data) {
@@ -176,16 +903,21 @@ bool RtmpStreamer::send_frame(unsigned char *frame, size_t size) {
     }
     want_data_muxex.unlock();
 
-    return send_frame_to_appsrc((void *)frame, size);
+    return send_frame_to_appsrc((void *)frame, size, ChannelOrder::RGB,
+                                regions);
 }
 
-bool RtmpStreamer::send_frame(cv::Mat &frame) {
+bool RtmpStreamer::send_frame(cv::Mat &frame,
+                              const std::vector<RegionOfInterest> &regions) {
     if (frame.empty()) {
         gst_printerr("Captured frame is empty.\n");
         return FALSE;
     }
 
     std::lock_guard<std::mutex> guard(handling_pipeline);
+    if (stream_paused) {
+        return FALSE;
+    }
 
     want_data_muxex.lock();
     if (!want_data) {
@@ -194,181 +926,1210 @@ bool RtmpStreamer::send_frame(cv::Mat &frame) {
     }
     want_data_muxex.unlock();
 
-    // Ensure the frame is in RGB format
-    cv::Mat temp_frame(screen_height, screen_width, CV_8UC1);
+    // The I420 converter reads packed BGR as is, videoconvert is fed RGB
+    int conversion = -1;
     if (frame.channels() == 4) {
-        cv::cvtColor(frame, temp_frame, cv::COLOR_BGRA2RGB);
+        conversion =
+            config.ingest_i420 ? cv::COLOR_BGRA2BGR : cv::COLOR_BGRA2RGB;
     } else if (frame.channels() == 3) {
-        cv::cvtColor(frame, temp_frame, cv::COLOR_BGR2RGB);
+        conversion = config.ingest_i420 ? -1 : cv::COLOR_BGR2RGB;
     } else {
         gst_printerr("Captured frame is not in a supported format.\n");
         return FALSE;
     }
 
-    if (!send_frame_to_appsrc((void *)frame.data,
-                              frame.total() * frame.elemSize())) {
-        return FALSE;
+    cv::Mat packed_frame = frame;
+    if (conversion >= 0) {
+        cv::cvtColor(frame, packed_frame, conversion);
+    } else if (!frame.isContinuous()) {
+        packed_frame = frame.clone();
+    }
+    ChannelOrder order =
+        config.ingest_i420 ? ChannelOrder::BGR : ChannelOrder::RGB;
+
+    if (!send_frame_to_appsrc((void *)packed_frame.data,
+                              packed_frame.total() * packed_frame.elemSize(),
+                              order, regions)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+bool RtmpStreamer::pull_preview_frame(cv::Mat &frame, uint timeout_ms) {
+    if (config.preview_sink != PreviewSink::App) {
+        gst_printerr("preview sink is not an appsink\n");
+        return false;
+    }
+
+    GstElement *sink = get_element_by_name("local_video_sink");
+    if (!sink) {
+        gst_printerr("unable to find local video sink\n");
+        return false;
+    }
+
+    GstSample *sample = gst_app_sink_try_pull_sample(
+        GST_APP_SINK(sink), (GstClockTime)timeout_ms * GST_MSECOND);
+    gst_object_unref(sink);
+    if (!sample) {
+        return false;
+    }
+
+    GstVideoInfo info;
+    GstVideoFrame video_frame;
+    bool copied = false;
+    if (gst_video_info_from_caps(&info, gst_sample_get_caps(sample)) &&
+        gst_video_frame_map(&video_frame, &info, gst_sample_get_buffer(sample),
+                            GST_MAP_READ)) {
+        // Wrap the mapped plane with its stride and copy it out, the sample
+        // is released before returning
+        cv::Mat view(GST_VIDEO_INFO_HEIGHT(&info), GST_VIDEO_INFO_WIDTH(&info),
+                     CV_8UC3, GST_VIDEO_FRAME_PLANE_DATA(&video_frame, 0),
+                     GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame, 0));
+        view.copyTo(frame);
+        gst_video_frame_unmap(&video_frame);
+        copied = true;
+    }
+
+    gst_sample_unref(sample);
+    return copied;
+}
+
+void RtmpStreamer::async_streamer_control_unit() {
+    std::string command;
+    std::getline(std::cin, command);
+
+    do {
+        if (std::strcmp(command.c_str(), "start_stream") == 0) {
+            start_stream();
+        } else if (std::strcmp(command.c_str(), "stop_stream") == 0) {
+            stop_stream();
+        } else if (std::strcmp(command.c_str(), "pause_stream") == 0) {
+            pause_stream();
+        } else if (std::strcmp(command.c_str(), "resume_stream") == 0) {
+            resume_stream();
+        } else if (std::strcmp(command.c_str(), "stop_rtmp_stream") == 0) {
+            stop_rtmp_stream();
+        } else if (std::strcmp(command.c_str(), "stop_local_stream") == 0) {
+            stop_local_stream();
+        } else if (std::strcmp(command.c_str(), "start_rtmp_stream") == 0) {
+            start_rtmp_stream();
+        } else if (std::strcmp(command.c_str(), "start_local_stream") == 0) {
+            start_local_stream();
+        } else if (std::strcmp(command.c_str(), "standby_rtmp_stream") == 0) {
+            standby_rtmp_stream();
+        } else if (std::strcmp(command.c_str(), "resume_rtmp_stream") == 0) {
+            resume_rtmp_stream();
+        } else if (std::strcmp(command.c_str(), "request_keyframe") == 0) {
+            if (!request_keyframe()) {
+                gst_printerr("\nUnable to request keyframe.\n");
+            }
+        } else if (std::strcmp(command.c_str(), "quit") == 0) {
+            break;
+        } else {
+            gst_printerr("\nInvalid command.\n");
+        }
+    } while (std::getline(std::cin, command));
+}
+
+void RtmpStreamer::debug_info() {
+    const char *possible_states[5] = {"Void Pending", "Null", "Ready", "Paused",
+                                      "Playing"};
+    gst_println(
+        "\n----------------- START DEBUG INFO "
+        "-----------------------\n");
+    gst_println("pipeline state: %s (pending state: %s)\n",
+                possible_states[pipeline->current_state],
+                possible_states[pipeline->pending_state]);
+    gchar *name;
+    GST_OBJECT_LOCK(pipeline);
+    GList *pipeline_children = GST_BIN(pipeline)->children;
+
+    while (pipeline_children) {
+        GstBin *bin = GST_BIN(pipeline_children->data);
+        gst_println("###### BIN: %s ######", gst_pad_get_name(bin));
+        gst_println("bin state: %s (pending state: %s)\n",
+                    possible_states[GST_ELEMENT(pipeline_children->data)
+                                        ->current_state],
+                    possible_states[GST_ELEMENT(pipeline_children->data)
+                                        ->pending_state]);
+
+        GList *pads = GST_ELEMENT(pipeline_children->data)->pads;
+        gst_println("--- Bin Pads ---");
+        while (pads) {
+            GstPad *pad = GST_PAD(pads->data);
+            name = gst_pad_get_name(pad);
+            gst_println("bin pad: %s (is linked: %s)", name,
+                        gst_pad_is_linked(pad) ? "true" : "false");
+            g_free(name);
+            pads = pads->next;
+        }
+
+        gst_println("\n--- Elements ---");
+        GList *elements = bin->children;
+        while (elements) {
+            GstElement *element = GST_ELEMENT(elements->data);
+            name = gst_element_get_name(element);
+            gst_println("element: %s", name);
+            g_free(name);
+            gst_println("- element state: %s (pending state: %s)",
+                        possible_states[element->current_state],
+                        possible_states[element->pending_state]);
+
+            GList *pads = element->pads;
+            gst_println("element pads:");
+            while (pads) {
+                GstPad *pad = GST_PAD(pads->data);
+                name = gst_pad_get_name(pad);
+                gst_println("- element pad: %s (is linked: %s)", name,
+                            gst_pad_is_linked(pad) ? "true" : "false");
+                g_free(name);
+
+                pads = pads->next;
+            }
+            elements = elements->next;
+            gst_print("\n");
+        }
+        pipeline_children = pipeline_children->next;
+        gst_print("\n");
+    }
+    GST_OBJECT_UNLOCK(pipeline);
+    gst_println("----------------- END DEBUG INFO -----------------------\n");
+}
+
+/**
+ * @brief Builds the gst-launch description of the local video bin.
+ *
+ * Frame rate reduction runs before scaling so dropped frames are never
+ * scaled, and the leaky queue keeps a slow preview from stalling the source.
+ */
+static std::string preview_bin_description(const StreamerConfig &config) {
+    std::string description =
+        "queue name=local_video_queue leaky=downstream max-size-buffers=1 ";
+
+    std::string caps;
+    if (config.preview_frame_rate > 0) {
+        description += "! videorate name=preview_rate drop-only=true ";
+        caps += fmt::format(",framerate={}/1", config.preview_frame_rate);
+    }
+    if (config.preview_width > 0 && config.preview_height > 0) {
+        description += "! videoscale name=preview_scale " +
+                       convert_thread_options(config);
+        caps += fmt::format(",width={},height={}", config.preview_width,
+                            config.preview_height);
+    }
+    if (config.preview_sink == PreviewSink::App) {
+        description += "! videoconvert name=preview_convert " +
+                       convert_thread_options(config);
+        caps += ",format=BGR";
+    }
+    if (!caps.empty()) {
+        description += fmt::format("! video/x-raw{} ", caps);
+    }
+
+    switch (config.preview_sink) {
+        case PreviewSink::Fake:
+            description += "! fakesink name=local_video_sink sync=false";
+            break;
+        case PreviewSink::App:
+            description +=
+                "! appsink name=local_video_sink sync=false max-buffers=1 "
+                "drop=true";
+            break;
+        case PreviewSink::SharedMemory:
+            description += fmt::format(
+                "! shmsink name=local_video_sink socket-path={} sync=false "
+                "wait-for-connection=false",
+                config.preview_shm_path);
+            break;
+        case PreviewSink::Window:
+        default:
+            description += "! autovideosink name=local_video_sink";
+            break;
+    }
+
+    return description;
+}
+
+void RtmpStreamer::initialize_streamer() {
+    gst_init(nullptr, nullptr);
+
+    pipeline = gst_pipeline_new("video pipeline");
+
+    if (!pipeline) {
+        gst_printerr("unable to create pipeline\n");
+        exit(1);
+    }
+
+    // TODO: add functionality to change the default values
+    // The built-in converter produces BT.709, which GStreamer would only
+    // assume for I420 above SD resolution
+    std::string color_format =
+        config.ingest_i420 ? "I420,colorimetry=bt709" : "RGB";
+
+    // Overlays are placed after videorate so only output frames are blended.
+    // Both elements cache the rendered text and only re-render it when it
+    // changes, the blending itself runs on the appsrc streaming thread.
+    std::string overlay_string;
+    if (config.overlay_clock) {
+        overlay_string += fmt::format(
+            "! clockoverlay name=clock_overlay time-format=\"{}\" "
+            "font-desc=\"{}\" halignment=right valignment=top ",
+            config.overlay_clock_format, config.overlay_font);
+    }
+    if (config.overlay_text) {
+        overlay_string += fmt::format(
+            "! textoverlay name=text_overlay font-desc=\"{}\" "
+            "halignment=left valignment=top ",
+            config.overlay_font);
+    }
+
+    auto source_setup_string = fmt::format(
+        "appsrc name=appsrc is-live=true block=true format=GST_FORMAT_TIME "
+        "caps=video/x-raw,format={0},framerate={1}/1,width={2},height={3} "
+        "! videoconvert name=videoconvert {5}! videoscale name=videoscale {5}"
+        "! videorate name=videorate "
+        "! capsfilter name=output_caps caps=video/x-raw,framerate={4}/1 "
+        "{6}! tee name=tee "
+        "tee. ! fakesink name=snapshot_sink sync=false async=false "
+        "enable-last-sample=true",
+        color_format, frame_rate_in, screen_width, screen_height,
+        frame_rate_out, convert_thread_options(config), overlay_string);
+
+    source_bin = gst_parse_bin_from_description(source_setup_string.c_str(),
+                                                false, nullptr);
+    source_bin_name = gst_element_get_name(source_bin);
+
+    const EncoderProfile &encoder_profile =
+        get_encoder_profile(config.encoder.backend);
+    if (!is_encoder_available(config.encoder.backend)) {
+        gst_printerr("encoder %s or its parser is not installed\n",
+                     encoder_profile.factory);
+        exit(1);
+    }
+    if (!encoder_profile.flv_compatible) {
+        gst_printerr("encoder %s can not be muxed into FLV for RTMP\n",
+                     encoder_profile.factory);
+        exit(1);
+    }
+
+    // flvmux only takes length prefixed H.264, which encoders producing a
+    // byte-stream only deliver through the parser
+    std::string encoded_parse_string, rtmp_parse_string;
+    if (encoder_profile.parser) {
+        encoded_parse_string =
+            fmt::format("! {} name=encoded_parse {} ", encoder_profile.parser,
+                        encoder_profile.parser_options);
+        rtmp_parse_string =
+            fmt::format("! {} name=rtmp_parse {} ", encoder_profile.parser,
+                        encoder_profile.parser_options);
+    }
+
+    // The capsfilter is left open so videoscale passes frames through, until
+    // the adaptive bitrate controller lowers the resolution. rtmp_sink does
+    // not preroll, a bin attached in standby behind a dropping valve would
+    // otherwise hold the pipeline short of PLAYING until the stream goes live.
+    auto rtmp_format_string = fmt::format(
+        "videoscale name=rtmp_scale {}! capsfilter name=rtmp_caps "
+        "! {} "
+        "! tee name=encoded_tee "
+        "encoded_tee. ! valve name=rtmp_valve drop=false "
+        "! queue name=rtmp_queue max-size-buffers={} max-size-bytes={} "
+        "max-size-time={} {}! flvmux name=flvmux streamable=true "
+        "! rtmp2sink name=rtmp_sink location={} async=false "
+        "encoded_tee. ! valve name=encoded_valve drop=true "
+        "! queue name=encoded_queue leaky=downstream max-size-buffers=0 "
+        "max-size-bytes=0 max-size-time=2000000000 "
+        "{}! {} "
+        "! appsink name=encoded_sink sync=false async=false",
+        convert_thread_options(config),
+        encoder_description(config.encoder, "video_encoder", frame_rate_out),
+        RTMP_QUEUE_MAX_BUFFERS, RTMP_QUEUE_MAX_BYTES, RTMP_QUEUE_MAX_TIME,
+        rtmp_parse_string, rtmp_streaming_addr, encoded_parse_string,
+        encoder_profile.stream_caps);
+
+    rtmp_bin = gst_parse_bin_from_description(rtmp_format_string.c_str(), true,
+                                              nullptr);
+    rtmp_bin_name = gst_element_get_name(rtmp_bin);
+
+    local_video_bin = gst_parse_bin_from_description(
+        preview_bin_description(config).c_str(), true, nullptr);
+    local_video_bin_name = gst_element_get_name(local_video_bin);
+
+    if (!source_bin || !rtmp_bin || !local_video_bin) {
+        gst_printerrln("Error setting up bins.");
+        exit(1);
+    }
+    rtmp_bin_ref = GST_ELEMENT(gst_object_ref(rtmp_bin));
+    local_video_bin_ref = GST_ELEMENT(gst_object_ref(local_video_bin));
+
+    GstElement *encoded_sink =
+        gst_bin_get_by_name(GST_BIN(rtmp_bin), "encoded_sink");
+    if (!encoded_sink) {
+        gst_printerr("error extracting encoded packet appsink\n");
+        exit(1);
+    }
+    GstAppSinkCallbacks encoded_sink_callbacks = {};
+    encoded_sink_callbacks.new_sample = cb_new_encoded_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(encoded_sink),
+                               &encoded_sink_callbacks, this, nullptr);
+    gst_object_unref(encoded_sink);
+
+    GstElement *encoder =
+        gst_bin_get_by_name(GST_BIN(rtmp_bin), "video_encoder");
+    GstPad *encoder_src_pad = gst_element_get_static_pad(encoder, "src");
+    if (config.embed_timestamps) {
+        if (g_str_has_prefix(encoder_profile.stream_caps, "video/x-h264")) {
+            // Added first, so the encoder input time is still known and the
+            // byte counters include the SEI
+            ingest_meta_caps =
+                gst_caps_new_empty_simple("timestamp/x-rtmp-streamer-ingest");
+            gst_pad_add_probe(encoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                              cb_embed_timestamps, this, nullptr);
+        } else {
+            gst_printerr("timestamps can only be embedded into H.264\n");
+        }
+    }
+    gst_pad_add_probe(encoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      cb_count_encoded_bytes, this, nullptr);
+    gst_pad_add_probe(encoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      cb_encoder_output, this, nullptr);
+    gst_object_unref(encoder_src_pad);
+
+    // Measures the encode time and skips frames for the CPU QoS controller
+    GstPad *encoder_input_pad = gst_element_get_static_pad(encoder, "sink");
+    gst_pad_add_probe(encoder_input_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      cb_encoder_input, this, nullptr);
+    gst_object_unref(encoder_input_pad);
+
+    const GopSettings &gop = config.encoder.gop;
+    if (gop.align_to_wall_clock && gop_interval_frames(gop, frame_rate_out)) {
+        gop_align_interval_ms = gop_interval_ms(gop, frame_rate_out);
+        GstPad *encoder_sink_pad = gst_element_get_static_pad(encoder, "sink");
+        gst_pad_add_probe(encoder_sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          cb_align_keyframe, this, nullptr);
+        gst_object_unref(encoder_sink_pad);
+    }
+    gst_object_unref(encoder);
+
+    GstElement *rtmp_valve = gst_bin_get_by_name(GST_BIN(rtmp_bin), "rtmp_valve");
+    GstPad *rtmp_valve_src_pad = gst_element_get_static_pad(rtmp_valve, "src");
+    gst_pad_add_probe(rtmp_valve_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      cb_rtmp_output, this, nullptr);
+    gst_object_unref(rtmp_valve_src_pad);
+    gst_object_unref(rtmp_valve);
+
+    output_width = screen_width;
+    output_height = screen_height;
+    metrics.target_bitrate_kbps = config.encoder.bitrate_kbps;
+    metrics.output_width = output_width;
+    metrics.output_height = output_height;
+
+    gst_bin_add(GST_BIN(pipeline), source_bin);
+
+    bus = gst_element_get_bus(pipeline);
+    gst_bus_set_sync_handler(bus, cb_bus_sync, this, nullptr);
+
+    appsrc = gst_bin_get_by_name(GST_BIN(source_bin), "appsrc");
+    if (!appsrc) {
+        gst_printerr("error extracting appsrc\n");
+        exit(1);
+    }
+    if (config.ingest_i420 && !configure_ingest_pool()) {
+        exit(1);
+    }
+
+    monitor_running = true;
+    monitor_thread = std::thread(&RtmpStreamer::monitor_loop, this);
+}
+
+void RtmpStreamer::enable_cpu_qos(const CpuQosConfig &qos_config,
+                                  CpuQosEventCallback callback) {
+    std::lock_guard<std::mutex> guard(monitor_mutex);
+    cpu_qos_config = qos_config;
+    cpu_qos_config.max_frame_divisor =
+        std::max(1u, cpu_qos_config.max_frame_divisor);
+    cpu_qos_callback = std::move(callback);
+    cpu_qos_base_preset = config.encoder.speed_preset;
+    cpu_qos_idle_intervals = 0;
+    cpu_qos_last_step = std::chrono::steady_clock::now();
+    cpu_qos_enabled = true;
+}
+
+void RtmpStreamer::disable_cpu_qos() {
+    std::lock_guard<std::mutex> guard(monitor_mutex);
+    cpu_qos_enabled = false;
+    cpu_qos_callback = nullptr;
+    frame_divisor = 1;
+}
+
+void RtmpStreamer::monitor_loop() {
+    auto last_refresh = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(monitor_mutex);
+    while (monitor_running) {
+        // A pending reconnection attempt may be due before the next refresh
+        auto wake_up = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(MONITOR_INTERVAL_MS);
+        if (rtmp_outage && !rtmp_awaiting_connection) {
+            wake_up = std::min(wake_up, rtmp_next_attempt);
+        }
+        monitor_cv.wait_until(lock, wake_up);
+        if (!monitor_running) {
+            break;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        update_network_metrics(
+            std::chrono::duration<double>(now - last_refresh).count());
+        update_encoder_metrics();
+        last_refresh = now;
+
+        if (config.reconnect.enabled) {
+            reconnect_step(now);
+        }
+
+        if (adaptive_bitrate_enabled &&
+            now - adaptive_bitrate_last_step >=
+                std::chrono::milliseconds(
+                    adaptive_bitrate_config.interval_ms)) {
+            adaptive_bitrate_step();
+            adaptive_bitrate_last_step = now;
+        }
+
+        if (cpu_qos_enabled &&
+            now - cpu_qos_last_step >=
+                std::chrono::milliseconds(cpu_qos_config.interval_ms)) {
+            cpu_qos_step();
+            cpu_qos_last_step = now;
+        }
+    }
+}
+
+void RtmpStreamer::update_encoder_metrics() {
+    double encode_time;
+    uint frames;
+    {
+        std::lock_guard<std::mutex> guard(encode_time_mutex);
+        encode_time = encode_time_total;
+        frames = encoded_frames;
+        encode_time_total = 0.0;
+        encoded_frames = 0;
+    }
+
+    std::lock_guard<std::mutex> guard(metrics_mutex);
+    metrics.frames_skipped = frames_skipped;
+    if (frames == 0) {
+        return;
+    }
+    // Skipped frames leave the encoder more time for the next one
+    double frame_interval = (double)frame_divisor / frame_rate_out;
+    metrics.encoder_load = encode_time / frames / frame_interval;
+}
+
+void RtmpStreamer::update_network_metrics(double elapsed_seconds) {
+    double queue_fill = 0.0;
+    GstElement *queue = get_element_by_name("rtmp_queue");
+    if (queue) {
+        guint level_buffers, max_buffers, level_bytes, max_bytes;
+        guint64 level_time, max_time;
+        g_object_get(queue, "current-level-buffers", &level_buffers,
+                     "max-size-buffers", &max_buffers, "current-level-bytes",
+                     &level_bytes, "max-size-bytes", &max_bytes,
+                     "current-level-time", &level_time, "max-size-time",
+                     &max_time, nullptr);
+        gst_object_unref(queue);
+
+        // The queue is full as soon as any of its limits is reached
+        if (max_buffers > 0) {
+            queue_fill = std::max(queue_fill, (double)level_buffers / max_buffers);
+        }
+        if (max_bytes > 0) {
+            queue_fill = std::max(queue_fill, (double)level_bytes / max_bytes);
+        }
+        if (max_time > 0) {
+            queue_fill = std::max(queue_fill, (double)level_time / max_time);
+        }
+    }
+
+    guint64 rtmp_bytes_total = last_rtmp_bytes_total;
+    GstElement *sink = get_element_by_name("rtmp_sink");
+    if (sink) {
+        GstStructure *stats = nullptr;
+        g_object_get(sink, "stats", &stats, nullptr);
+        if (stats) {
+            gst_structure_get_uint64(stats, "out-bytes-total",
+                                     &rtmp_bytes_total);
+            gst_structure_free(stats);
+        }
+        gst_object_unref(sink);
+    }
+
+    if (rtmp_bytes_total > 0) {
+        rtmp_connected_once = true;
+    }
+
+    guint64 encoded_total = encoded_bytes_total.load();
+    guint64 peak_bytes = peak_window_bytes.exchange(0);
+    double encoded_delta = (double)(encoded_total - last_encoded_bytes_total);
+    // A new connection restarts the counters of rtmp2sink
+    double rtmp_delta = rtmp_bytes_total >= last_rtmp_bytes_total
+                            ? (double)(rtmp_bytes_total - last_rtmp_bytes_total)
+                            : (double)rtmp_bytes_total;
+    last_encoded_bytes_total = encoded_total;
+    last_rtmp_bytes_total = rtmp_bytes_total;
+
+    std::lock_guard<std::mutex> guard(metrics_mutex);
+    metrics.rtmp_queue_fill = std::min(queue_fill, 1.0);
+    if (elapsed_seconds > 0.0) {
+        metrics.encoder_output_kbps = encoded_delta * 8.0 / 1000.0 /
+                                      elapsed_seconds;
+        metrics.rtmp_output_kbps = rtmp_delta * 8.0 / 1000.0 / elapsed_seconds;
+    }
+    metrics.encoder_peak_kbps = peak_bytes * 8.0 / 1000.0;
+}
+
+void RtmpStreamer::adaptive_bitrate_step() {
+    const AdaptiveBitrateConfig &abr = adaptive_bitrate_config;
+
+    double queue_fill, encoder_kbps, rtmp_kbps;
+    {
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        queue_fill = metrics.rtmp_queue_fill;
+        encoder_kbps = metrics.encoder_output_kbps;
+        rtmp_kbps = metrics.rtmp_output_kbps;
+    }
+
+    // The uplink is falling behind when the queue fills up, or when less is
+    // sent than encoded while the queue is not draining
+    bool congested = queue_fill > abr.high_watermark ||
+                     (queue_fill > abr.low_watermark && encoder_kbps > 0.0 &&
+                      rtmp_kbps < 0.8 * encoder_kbps);
+    bool healthy = queue_fill < abr.low_watermark;
+
+    uint bitrate = config.encoder.bitrate_kbps;
+    uint new_bitrate = bitrate;
+    if (congested) {
+        adaptive_bitrate_healthy_intervals = 0;
+        new_bitrate = std::max(abr.min_bitrate_kbps,
+                               (uint)(bitrate * abr.step_down_factor));
+    } else if (healthy) {
+        if (++adaptive_bitrate_healthy_intervals >=
+            abr.step_up_hold_intervals) {
+            adaptive_bitrate_healthy_intervals = 0;
+            new_bitrate = std::min(abr.max_bitrate_kbps,
+                                   (uint)(bitrate * abr.step_up_factor));
+        }
+    } else {
+        adaptive_bitrate_healthy_intervals = 0;
+    }
+
+    if (new_bitrate == bitrate) {
+        return;
+    }
+    if (!apply_bitrate(new_bitrate)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        if (new_bitrate < bitrate) {
+            metrics.adaptive_bitrate_steps_down++;
+        } else {
+            metrics.adaptive_bitrate_steps_up++;
+        }
+    }
+
+    if (abr.allow_resolution_change) {
+        double scale = 1.0;
+        if (new_bitrate < abr.max_bitrate_kbps / 4) {
+            scale = 0.5;
+        } else if (new_bitrate < abr.max_bitrate_kbps / 2) {
+            scale = 0.75;
+        }
+        if (scale != rtmp_output_scale) {
+            set_rtmp_output_scale(scale);
+        }
+    }
+}
+
+void RtmpStreamer::cpu_qos_step() {
+    const CpuQosConfig &qos = cpu_qos_config;
+
+    double load;
+    {
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        load = metrics.encoder_load;
+    }
+
+    const size_t preset_count = sizeof(speed_presets) / sizeof(*speed_presets);
+    size_t preset = std::find(speed_presets, speed_presets + preset_count,
+                              config.encoder.speed_preset) -
+                    speed_presets;
+    size_t base_preset = std::find(speed_presets, speed_presets + preset_count,
+                                   cpu_qos_base_preset) -
+                         speed_presets;
+    uint divisor = frame_divisor;
+
+    // A faster preset costs less quality than skipped frames, so it is
+    // tried first and undone last
+    CpuQosEvent event = {CpuQosAction::FasterPreset, load, "", divisor};
+    bool stepped = false;
+    if (load > qos.high_load) {
+        cpu_qos_idle_intervals = 0;
+        if (preset > 0 && preset < preset_count &&
+            set_speed_preset(speed_presets[preset - 1])) {
+            event.action = CpuQosAction::FasterPreset;
+            stepped = true;
+        } else if (divisor < qos.max_frame_divisor) {
+            frame_divisor = divisor + 1;
+            event.action = CpuQosAction::SkipMoreFrames;
+            stepped = true;
+        }
+    } else if (load < qos.low_load) {
+        if (++cpu_qos_idle_intervals < qos.recover_hold_intervals) {
+            return;
+        }
+        cpu_qos_idle_intervals = 0;
+
+        // Only encode more frames if the predicted load stays below the
+        // high watermark
+        if (divisor > 1 && load * divisor / (divisor - 1) < qos.high_load) {
+            frame_divisor = divisor - 1;
+            event.action = CpuQosAction::SkipFewerFrames;
+            stepped = true;
+        } else if (divisor == 1 && preset < base_preset &&
+                   base_preset < preset_count &&
+                   set_speed_preset(speed_presets[preset + 1])) {
+            event.action = CpuQosAction::SlowerPreset;
+            stepped = true;
+        }
+    } else {
+        cpu_qos_idle_intervals = 0;
+    }
+
+    if (!stepped) {
+        return;
+    }
+    if (cpu_qos_callback) {
+        event.speed_preset = config.encoder.speed_preset;
+        event.frame_divisor = frame_divisor;
+        cpu_qos_callback(event);
+    }
+}
+
+void RtmpStreamer::reconnect_step(std::chrono::steady_clock::time_point now) {
+    const ReconnectConfig &reconnect = config.reconnect;
+
+    // The usual limits return once the replay has drained from the queue
+    if (rtmp_queue_widened && !rtmp_outage && !rtmp_restarted) {
+        narrow_rtmp_queue(false);
+    }
+
+    if (rtmp_connection_failed.exchange(false)) {
+        if (!rtmp_outage) {
+            gst_printerr("lost connection to the rtmp server\n");
+            rtmp_outage = true;
+            rtmp_outage_begin = now;
+            rtmp_outage_attempts = 0;
+            rtmp_reconnect_delay_ms = reconnect.initial_delay_ms;
+        } else {
+            rtmp_reconnect_delay_ms =
+                std::min(rtmp_reconnect_delay_ms * reconnect.backoff_factor,
+                         (double)reconnect.max_delay_ms);
+        }
+        rtmp_awaiting_connection = false;
+
+        double jitter = std::clamp(reconnect.jitter, 0.0, 1.0);
+        std::uniform_real_distribution<double> spread(1.0 - jitter,
+                                                      1.0 + jitter);
+        rtmp_next_attempt =
+            now + std::chrono::microseconds((int64_t)(
+                      rtmp_reconnect_delay_ms * spread(reconnect_random) *
+                      1000.0));
+
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        metrics.rtmp_reconnecting = true;
+    }
+
+    if (!rtmp_outage) {
+        return;
+    }
+
+    if (rtmp_awaiting_connection) {
+        // rtmp2sink restarts its counters with every connection, so any
+        // byte written belongs to the new one
+        guint64 bytes_written = 0;
+        GstElement *sink = get_element_by_name("rtmp_sink");
+        if (sink) {
+            GstStructure *stats = nullptr;
+            g_object_get(sink, "stats", &stats, nullptr);
+            if (stats) {
+                gst_structure_get_uint64(stats, "out-bytes-total",
+                                         &bytes_written);
+                gst_structure_free(stats);
+            }
+            gst_object_unref(sink);
+        }
+        if (bytes_written == 0) {
+            return;
+        }
+
+        gst_print("reconnected to the rtmp server\n");
+        rtmp_outage = false;
+        rtmp_awaiting_connection = false;
+
+        // FLV has to start with a keyframe carrying the codec headers, the
+        // replay buffer starts with one unless the GOP did not fit
+        bool replay_available;
+        {
+            std::lock_guard<std::mutex> guard(replay_mutex);
+            replay_available = !replay_packets.empty();
+        }
+        rtmp_reconnecting = false;
+        if (!replay_available) {
+            request_keyframe();
+        }
+
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        metrics.rtmp_reconnecting = false;
+        metrics.rtmp_reconnects++;
+        metrics.rtmp_last_downtime_ms =
+            std::chrono::duration<double, std::milli>(now - rtmp_outage_begin)
+                .count();
+        return;
+    }
+
+    if (now < rtmp_next_attempt) {
+        return;
+    }
+
+    if (reconnect.max_attempts > 0 &&
+        rtmp_outage_attempts >= reconnect.max_attempts) {
+        GstElement *sink = get_element_by_name("rtmp_sink");
+        if (sink) {
+            // Handed to the bus, so check_error reports the lost stream
+            rtmp_reconnect_gave_up = true;
+            GError *error = g_error_new(
+                GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_OPEN_WRITE,
+                "unable to reconnect to the rtmp server after %u attempts",
+                rtmp_outage_attempts);
+            gst_element_post_message(
+                sink, gst_message_new_error(GST_OBJECT(sink), error, nullptr));
+            g_error_free(error);
+            gst_object_unref(sink);
+        }
+        rtmp_outage = false;
+        return;
+    }
+
+    rtmp_outage_attempts++;
+    {
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        metrics.rtmp_reconnect_attempts++;
+    }
+
+    if (restart_rtmp_sink()) {
+        rtmp_awaiting_connection = true;
+    } else {
+        rtmp_connection_failed = true;
+    }
+}
+
+bool RtmpStreamer::restart_rtmp_sink() {
+    std::lock_guard<std::mutex> guard(handling_pipeline);
+
+    GstElement *bin = gst_bin_get_by_name(GST_BIN(pipeline), rtmp_bin_name);
+    if (!bin) {
+        return false;
+    }
+    GstElement *valve = gst_bin_get_by_name(GST_BIN(bin), "rtmp_valve");
+    GstElement *queue = gst_bin_get_by_name(GST_BIN(bin), "rtmp_queue");
+    GstElement *parse = gst_bin_get_by_name(GST_BIN(bin), "rtmp_parse");
+    GstElement *mux = gst_bin_get_by_name(GST_BIN(bin), "flvmux");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(bin), "rtmp_sink");
+    gst_object_unref(bin);
+
+    bool restarted = valve && queue && mux && sink;
+    if (restarted) {
+        GstPad *valve_src_pad = gst_element_get_static_pad(valve, "src");
+        GstPad *queue_sink_pad = gst_element_get_static_pad(queue, "sink");
+        gst_pad_unlink(valve_src_pad, queue_sink_pad);
+
+        // Only encoders with a parser have one in front of the muxer
+        gst_element_set_state(queue, GST_STATE_NULL);
+        if (parse) {
+            gst_element_set_state(parse, GST_STATE_NULL);
+        }
+        gst_element_set_state(mux, GST_STATE_NULL);
+        gst_element_set_state(sink, GST_STATE_NULL);
+        widen_rtmp_queue(queue);
+        restarted = gst_element_sync_state_with_parent(sink) &&
+                    gst_element_sync_state_with_parent(mux) &&
+                    (!parse || gst_element_sync_state_with_parent(parse)) &&
+                    gst_element_sync_state_with_parent(queue);
+
+        // Relinking resends the sticky caps and segment to the new muxer
+        if (gst_pad_link(valve_src_pad, queue_sink_pad) != GST_PAD_LINK_OK) {
+            gst_printerr("unable to relink rtmp queue\n");
+            restarted = false;
+        }
+        gst_object_unref(valve_src_pad);
+        gst_object_unref(queue_sink_pad);
+    }
+
+    for (GstElement *element : {valve, queue, parse, mux, sink}) {
+        if (element) {
+            gst_object_unref(element);
+        }
+    }
+    if (!restarted) {
+        gst_printerr("unable to restart rtmp sink\n");
+        return false;
+    }
+
+    // Frames are still dropped until the new connection is confirmed, a
+    // server that can not be reached would otherwise fill the queue and
+    // block the encoder
+    rtmp_restarted = true;
+    return true;
+}
+
+void RtmpStreamer::widen_rtmp_queue(GstElement *queue) {
+    size_t replay_cap = config.reconnect.replay_buffer_bytes;
+    if (replay_cap == 0) {
+        return;
+    }
+
+    // The replay is pushed from the encoder thread and spans up to a whole
+    // GOP, so only the bytes are bounded, with room for the live frames
+    // arriving while it drains
+    guint max_bytes = (guint)std::min<size_t>(
+        replay_cap + RTMP_QUEUE_MAX_BYTES, G_MAXUINT);
+    g_object_set(queue, "max-size-buffers", 0u, "max-size-bytes", max_bytes,
+                 "max-size-time", (guint64)0, nullptr);
+    rtmp_queue_widened = true;
+}
+
+void RtmpStreamer::narrow_rtmp_queue(bool force) {
+    GstElement *queue = get_element_by_name("rtmp_queue");
+    if (!queue) {
+        return;
+    }
+
+    guint level_buffers, level_bytes;
+    guint64 level_time;
+    g_object_get(queue, "current-level-buffers", &level_buffers,
+                 "current-level-bytes", &level_bytes, "current-level-time",
+                 &level_time, nullptr);
+    if (force || (level_buffers < RTMP_QUEUE_MAX_BUFFERS &&
+                  level_bytes < RTMP_QUEUE_MAX_BYTES &&
+                  level_time < RTMP_QUEUE_MAX_TIME)) {
+        g_object_set(queue, "max-size-buffers", (guint)RTMP_QUEUE_MAX_BUFFERS,
+                     "max-size-bytes", (guint)RTMP_QUEUE_MAX_BYTES,
+                     "max-size-time", (guint64)RTMP_QUEUE_MAX_TIME, nullptr);
+        rtmp_queue_widened = false;
+    }
+    gst_object_unref(queue);
+}
+
+void RtmpStreamer::reset_reconnect() {
+    if (rtmp_queue_widened) {
+        narrow_rtmp_queue(true);
+    }
+    rtmp_reconnecting = false;
+    rtmp_connection_failed = false;
+    rtmp_reconnect_gave_up = false;
+    rtmp_connected_once = false;
+    rtmp_outage = false;
+    rtmp_awaiting_connection = false;
+
+    rtmp_restarted = false;
+    {
+        std::lock_guard<std::mutex> guard(replay_mutex);
+        clear_replay_packets();
+    }
+
+    std::lock_guard<std::mutex> guard(metrics_mutex);
+    metrics.rtmp_reconnecting = false;
+}
+
+void RtmpStreamer::store_replay_packet(GstBuffer *buffer) {
+    size_t cap = config.reconnect.replay_buffer_bytes;
+    if (cap == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(replay_mutex);
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        clear_replay_packets();
+    } else if (replay_packets.empty()) {
+        // Delta frames are useless without the keyframe of their GOP
+        return;
+    }
+
+    replay_bytes += gst_buffer_get_size(buffer);
+    if (replay_bytes > cap) {
+        clear_replay_packets();
+        return;
+    }
+    replay_packets.push_back(gst_buffer_ref(buffer));
+}
+
+void RtmpStreamer::clear_replay_packets() {
+    for (GstBuffer *packet : replay_packets) {
+        gst_buffer_unref(packet);
+    }
+    replay_packets.clear();
+    replay_bytes = 0;
+}
+
+bool RtmpStreamer::set_speed_preset(const std::string &preset) {
+    if (config.encoder.backend != VideoEncoder::X264 &&
+        config.encoder.backend != VideoEncoder::X265) {
+        return false;
+    }
+
+    GstElement *encoder = get_element_by_name("video_encoder");
+    if (!encoder) {
+        return false;
     }
 
-    return TRUE;
-}
-
-void RtmpStreamer::async_streamer_control_unit() {
-    std::string command;
-    std::getline(std::cin, command);
-
-    do {
-        if (std::strcmp(command.c_str(), "start_stream") == 0) {
-            start_stream();
-        } else if (std::strcmp(command.c_str(), "stop_stream") == 0) {
-            stop_stream();
-        } else if (std::strcmp(command.c_str(), "stop_rtmp_stream") == 0) {
-            stop_rtmp_stream();
-        } else if (std::strcmp(command.c_str(), "stop_local_stream") == 0) {
-            stop_local_stream();
-        } else if (std::strcmp(command.c_str(), "start_rtmp_stream") == 0) {
-            start_rtmp_stream();
-        } else if (std::strcmp(command.c_str(), "start_local_stream") == 0) {
-            start_local_stream();
-        } else if (std::strcmp(command.c_str(), "quit") == 0) {
-            break;
-        } else {
-            gst_printerr("\nInvalid command.\n");
-        }
-    } while (std::getline(std::cin, command));
+    // Most encoders only read their preset when they are started
+    GParamSpec *spec = g_object_class_find_property(
+        G_OBJECT_GET_CLASS(encoder), "speed-preset");
+    bool mutable_playing = spec && (spec->flags & GST_PARAM_MUTABLE_PLAYING);
+    if (mutable_playing) {
+        gst_util_set_object_arg(G_OBJECT(encoder), "speed-preset",
+                                preset.c_str());
+        config.encoder.speed_preset = preset;
+    }
+    gst_object_unref(encoder);
+    return mutable_playing;
 }
 
-void RtmpStreamer::debug_info() {
-    const char *possible_states[5] = {"Void Pending", "Null", "Ready", "Paused",
-                                      "Playing"};
-    gst_println(
-        "\n----------------- START DEBUG INFO "
-        "-----------------------\n");
-    gst_println("pipeline state: %s (pending state: %s)\n",
-                possible_states[pipeline->current_state],
-                possible_states[pipeline->pending_state]);
-    gchar *name;
-    GST_OBJECT_LOCK(pipeline);
-    GList *pipeline_children = GST_BIN(pipeline)->children;
+bool RtmpStreamer::set_rtmp_output_scale(double scale) {
+    GstElement *caps_filter = get_element_by_name("rtmp_caps");
+    if (!caps_filter) {
+        gst_printerr("unable to find rtmp capsfilter\n");
+        return false;
+    }
 
-    while (pipeline_children) {
-        GstBin *bin = GST_BIN(pipeline_children->data);
-        gst_println("###### BIN: %s ######", gst_pad_get_name(bin));
-        gst_println("bin state: %s (pending state: %s)\n",
-                    possible_states[GST_ELEMENT(pipeline_children->data)
-                                        ->current_state],
-                    possible_states[GST_ELEMENT(pipeline_children->data)
-                                        ->pending_state]);
+    // Encoders need even dimensions for 4:2:0 subsampling
+    uint width = (uint)(output_width * scale) & ~1u;
+    uint height = (uint)(output_height * scale) & ~1u;
 
-        GList *pads = GST_ELEMENT(pipeline_children->data)->pads;
-        gst_println("--- Bin Pads ---");
-        while (pads) {
-            GstPad *pad = GST_PAD(pads->data);
-            name = gst_pad_get_name(pad);
-            gst_println("bin pad: %s (is linked: %s)", name,
-                        gst_pad_is_linked(pad) ? "true" : "false");
-            g_free(name);
-            pads = pads->next;
-        }
+    GstCaps *caps;
+    if (scale >= 1.0) {
+        caps = gst_caps_new_any();
+        width = output_width;
+        height = output_height;
+    } else {
+        caps = gst_caps_new_simple("video/x-raw", "width", G_TYPE_INT,
+                                   (gint)width, "height", G_TYPE_INT,
+                                   (gint)height, nullptr);
+    }
+    g_object_set(caps_filter, "caps", caps, nullptr);
+    gst_caps_unref(caps);
+    gst_object_unref(caps_filter);
+
+    rtmp_output_scale = scale;
+    std::lock_guard<std::mutex> guard(metrics_mutex);
+    metrics.output_width = width;
+    metrics.output_height = height;
+    return true;
+}
 
-        gst_println("\n--- Elements ---");
-        GList *elements = bin->children;
-        while (elements) {
-            GstElement *element = GST_ELEMENT(elements->data);
-            name = gst_element_get_name(element);
-            gst_println("element: %s", name);
-            g_free(name);
-            gst_println("- element state: %s (pending state: %s)",
-                        possible_states[element->current_state],
-                        possible_states[element->pending_state]);
+void RtmpStreamer::set_pipeline_state(GstState state) {
+    {
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        state_change_target = state;
+        state_change_begin = std::chrono::steady_clock::now();
+        state_change_pending = true;
+    }
 
-            GList *pads = element->pads;
-            gst_println("element pads:");
-            while (pads) {
-                GstPad *pad = GST_PAD(pads->data);
-                name = gst_pad_get_name(pad);
-                gst_println("- element pad: %s (is linked: %s)", name,
-                            gst_pad_is_linked(pad) ? "true" : "false");
-                g_free(name);
+    GstStateChangeReturn ret = gst_element_set_state(pipeline, state);
+    if (ret == GST_STATE_CHANGE_FAILURE) {
+        gst_printerr("unable to set pipeline state to %s\n",
+                     gst_element_state_get_name(state));
+        std::lock_guard<std::mutex> guard(metrics_mutex);
+        state_change_pending = false;
+        return;
+    }
 
-                pads = pads->next;
-            }
-            elements = elements->next;
-            gst_print("\n");
-        }
-        pipeline_children = pipeline_children->next;
-        gst_print("\n");
+    // Asynchronous changes are completed from the bus handler instead
+    if (ret != GST_STATE_CHANGE_ASYNC) {
+        record_state_change(state);
     }
-    GST_OBJECT_UNLOCK(pipeline);
-    gst_println("----------------- END DEBUG INFO -----------------------\n");
 }
 
-void RtmpStreamer::initialize_streamer() {
-    gst_init(nullptr, nullptr);
-
-    pipeline = gst_pipeline_new("video pipeline");
+void RtmpStreamer::record_state_change(GstState state) {
+    std::lock_guard<std::mutex> guard(metrics_mutex);
+    if (!state_change_pending || state != state_change_target) {
+        return;
+    }
+    state_change_pending = false;
+
+    double latency_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() -
+                            state_change_begin)
+                            .count();
+    if (state == GST_STATE_PLAYING) {
+        metrics.last_start_latency_ms = latency_ms;
+    } else {
+        metrics.last_stop_latency_ms = latency_ms;
+    }
+}
 
-    if (!pipeline) {
-        gst_printerr("unable to create pipeline\n");
-        exit(1);
+GstElement *RtmpStreamer::get_element_by_name(const char *name) {
+    // rtmp_bin and local_video_bin are reassigned by start and stop, the
+    // lifetime references stay valid on any thread
+    GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+    if (!element) {
+        element = gst_bin_get_by_name(GST_BIN(rtmp_bin_ref), name);
     }
+    if (!element) {
+        element = gst_bin_get_by_name(GST_BIN(local_video_bin_ref), name);
+    }
+    return element;
+}
 
-    // TODO: add functionality to change the default values
-    std::string color_format = "RGB";
-    int frame_rate_in = 30;
-    int frame_rate_out = 30;
+bool RtmpStreamer::set_rtmp_valve_drop(bool drop) {
+    GstElement *valve = get_element_by_name("rtmp_valve");
+    if (!valve) {
+        gst_printerr("unable to find rtmp valve\n");
+        return false;
+    }
+    g_object_set(valve, "drop", (gboolean)drop, nullptr);
+    gst_object_unref(valve);
+    return true;
+}
 
-    auto source_setup_string = fmt::format(
-        "appsrc name=appsrc is-live=true block=true format=GST_FORMAT_TIME "
-        "caps=video/x-raw,format={},framerate={}/1,width={},height={} "
-        "! videoconvert name=videoconvert ! videoscale name=videoscale ! "
-        "videorate name=videorate ! video/x-raw,framerate={}/1 ! tee name=tee",
-        color_format, frame_rate_in, screen_width, screen_height,
-        frame_rate_out);
+bool RtmpStreamer::request_keyframe() {
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), "video_encoder");
+    if (!encoder) {
+        return false;
+    }
 
-    source_bin = gst_parse_bin_from_description(source_setup_string.c_str(),
-                                                false, nullptr);
-    source_bin_name = gst_element_get_name(source_bin);
+    // The force-key-unit event travels upstream into the encoder from its
+    // src pad, so it is handled before the next frame is encoded
+    GstPad *encoder_src_pad = gst_element_get_static_pad(encoder, "src");
+    GstEvent *event = gst_video_event_new_upstream_force_key_unit(
+        GST_CLOCK_TIME_NONE, TRUE, 0);
+    gboolean handled = gst_pad_send_event(encoder_src_pad, event);
 
-    // TODO: add functionality to change the default values
-    int bitrate = 3500;
-    std::string speed_preset = "ultrafast";
+    gst_object_unref(encoder_src_pad);
+    gst_object_unref(encoder);
 
-    auto rtmp_format_string = fmt::format(
-        "x264enc name=x264_encoder tune=zerolatency speed-preset={} bitrate={} "
-        "! queue name=rtmp_queue ! flvmux name=flvmux streamable=true "
-        "! rtmp2sink name=rtmp_sink location={}",
-        speed_preset, bitrate, rtmp_streaming_addr);
+    if (!handled) {
+        gst_printerr("encoder did not handle force-key-unit event\n");
+    }
+    return handled;
+}
 
-    rtmp_bin = gst_parse_bin_from_description(rtmp_format_string.c_str(), true,
-                                              nullptr);
-    rtmp_bin_name = gst_element_get_name(rtmp_bin);
+bool RtmpStreamer::configure_ingest_pool() {
+    // Buffers still travelling through the pipeline keep the old pool
+    // alive, so a new pool is created instead of reconfiguring the old one
+    if (ingest_pool) {
+        gst_buffer_pool_set_active(ingest_pool, FALSE);
+        gst_object_unref(ingest_pool);
+    }
+    ingest_pool = gst_video_buffer_pool_new();
 
-    local_video_bin = gst_parse_bin_from_description(
-        "queue name=local_video_queue ! autovideosink name=local_video_sink",
-        true, nullptr);
-    local_video_bin_name = gst_element_get_name(local_video_bin);
+    GstCaps *caps = gst_app_src_get_caps(GST_APP_SRC(appsrc));
+    if (!caps || !gst_video_info_from_caps(&ingest_info, caps)) {
+        gst_printerr("unable to read the appsrc caps\n");
+        if (caps) {
+            gst_caps_unref(caps);
+        }
+        return false;
+    }
 
-    if (!source_bin || !rtmp_bin || !local_video_bin) {
-        gst_printerrln("Error setting up bins.");
-        exit(1);
+    GstStructure *pool_config = gst_buffer_pool_get_config(ingest_pool);
+    gst_buffer_pool_config_set_params(pool_config, caps,
+                                      (guint)GST_VIDEO_INFO_SIZE(&ingest_info),
+                                      4, 0);
+    gst_caps_unref(caps);
+    if (!gst_buffer_pool_set_config(ingest_pool, pool_config) ||
+        !gst_buffer_pool_set_active(ingest_pool, TRUE)) {
+        gst_printerr("unable to activate ingest buffer pool\n");
+        return false;
     }
+    return true;
+}
 
-    gst_bin_add(GST_BIN(pipeline), source_bin);
+void RtmpStreamer::add_region_of_interest_meta(
+    GstBuffer *buffer, const std::vector<RegionOfInterest> &regions) {
+    cv::Rect frame_rect(0, 0, screen_width, screen_height);
+    for (const RegionOfInterest &region : regions) {
+        cv::Rect rect = region.rect & frame_rect;
+        if (rect.empty()) {
+            continue;
+        }
 
-    appsrc = gst_bin_get_by_name(GST_BIN(source_bin), "appsrc");
-    if (!appsrc) {
-        gst_printerr("error extracting appsrc\n");
-        exit(1);
+        // vaapih264enc reads the quantizer offset from its own parameters
+        GstVideoRegionOfInterestMeta *meta =
+            gst_buffer_add_video_region_of_interest_meta(
+                buffer, "roi", rect.x, rect.y, rect.width, rect.height);
+        gst_video_region_of_interest_meta_add_param(
+            meta, gst_structure_new("roi/vaapi", "delta-qp", G_TYPE_INT,
+                                    region.delta_qp, nullptr));
     }
 }
 
-bool RtmpStreamer::send_frame_to_appsrc(void *data, size_t size) {
+bool RtmpStreamer::send_frame_to_appsrc(
+    void *data, size_t size, ChannelOrder order,
+    const std::vector<RegionOfInterest> &regions) {
     GstBuffer *buffer;
     GstFlowReturn ret;
+    int64_t ingest_us = ingest_meta_caps ? wall_clock_us() : 0;
+
+    const EncoderProfile &profile = get_encoder_profile(config.encoder.backend);
+    if (!regions.empty() && !profile.region_of_interest) {
+        gst_printerr("%s does not support regions of interest\n",
+                     profile.factory);
+        return FALSE;
+    }
 
-    // Create a new buffer
-    buffer = gst_buffer_new_allocate(nullptr, size, nullptr);
+    if (ingest_pool) {
+        if (size != (size_t)screen_width * screen_height * RGB_BYTES) {
+            gst_printerr("frame of %zu bytes does not match %ux%u\n", size,
+                         screen_width, screen_height);
+            return FALSE;
+        }
+        if (gst_buffer_pool_acquire_buffer(ingest_pool, &buffer, nullptr) !=
+            GST_FLOW_OK) {
+            gst_printerr("unable to acquire buffer from ingest pool\n");
+            return FALSE;
+        }
+
+        // Convert straight into the planes of the pooled buffer
+        GstVideoFrame video_frame;
+        if (!gst_video_frame_map(&video_frame, &ingest_info, buffer,
+                                 GST_MAP_WRITE)) {
+            gst_printerr("unable to map ingest buffer\n");
+            gst_buffer_unref(buffer);
+            return FALSE;
+        }
+        rgb_to_i420(
+            (const uint8_t *)data, screen_width * RGB_BYTES, order,
+            screen_width, screen_height,
+            (uint8_t *)GST_VIDEO_FRAME_PLANE_DATA(&video_frame, 0),
+            GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame, 0),
+            (uint8_t *)GST_VIDEO_FRAME_PLANE_DATA(&video_frame, 1),
+            GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame, 1),
+            (uint8_t *)GST_VIDEO_FRAME_PLANE_DATA(&video_frame, 2),
+            GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame, 2));
+        gst_video_frame_unmap(&video_frame);
+    } else {
+        // Create a new buffer
+        buffer = gst_buffer_new_allocate(nullptr, size, nullptr);
+
+        // Copy the cv::Mat data into the GStreamer buffer
+        GstMapInfo map;
+        gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+        memcpy(map.data, data, size);
+        gst_buffer_unmap(buffer, &map);
+    }
 
     GstClock *clock = gst_element_get_clock(appsrc);
     if (clock) {
@@ -382,7 +2143,8 @@ bool RtmpStreamer::send_frame_to_appsrc(void *data, size_t size) {
         GST_BUFFER_PTS(buffer) = timestamp;
         GST_BUFFER_DTS(buffer) = timestamp;
         GST_BUFFER_DURATION(buffer) =
-            (GstClockTime)gst_util_uint64_scale_int(GST_SECOND, 1, 30);
+            (GstClockTime)gst_util_uint64_scale_int(GST_SECOND, 1,
+                                                    frame_rate_in);
         gst_object_unref(clock);
     } else {
         gst_printerr("unable to open clock for appsrc!\n");
@@ -394,11 +2156,19 @@ bool RtmpStreamer::send_frame_to_appsrc(void *data, size_t size) {
         exit(1);
     }
 
-    // Copy the cv::Mat data into the GStreamer buffer
-    GstMapInfo map;
-    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
-    memcpy(map.data, data, size);
-    gst_buffer_unmap(buffer, &map);
+    add_region_of_interest_meta(buffer, regions);
+
+    // Travels with the frame through the conversions and the encoder, which
+    // copy metas without tags to their output
+    if (ingest_meta_caps) {
+        GstCaps *reference = gst_caps_new_simple(
+            "timestamp/x-rtmp-streamer-ingest", "frame-id", G_TYPE_UINT64,
+            (guint64)ingest_frame_id++, nullptr);
+        gst_buffer_add_reference_timestamp_meta(
+            buffer, reference, (GstClockTime)ingest_us * GST_USECOND,
+            GST_CLOCK_TIME_NONE);
+        gst_caps_unref(reference);
+    }
 
     // Push the buffer to appsrc
     g_signal_emit_by_name(appsrc, "push-buffer", buffer, &ret);
@@ -585,6 +2355,9 @@ bool RtmpStreamer::connect_sink_bin_to_source_bin(
 
     *sink_bin = nullptr;
 
+    // Let the new consumer start decoding without waiting for the next GOP
+    request_keyframe();
+
     // Unref objects
     gst_object_unref(src_ghost_pad);
     gst_object_unref(sink_ghost_pad);
@@ -640,6 +2413,401 @@ void RtmpStreamer::cb_enough_data(GstAppSrc *appsrc, gpointer user_data) {
     *want_data = false;
 }
 
+GstBusSyncReply RtmpStreamer::cb_bus_sync(GstBus *bus, GstMessage *msg,
+                                          gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_STATE_CHANGED &&
+        GST_MESSAGE_SRC(msg) == GST_OBJECT(streamer->pipeline)) {
+        GstState new_state;
+        gst_message_parse_state_changed(msg, nullptr, &new_state, nullptr);
+        streamer->record_state_change(new_state);
+    }
+
+    // Failures of the RTMP output are handled by the monitor thread without
+    // stopping the pipeline. The flag is raised here, on the failing thread,
+    // so frames are dropped before the error flows back into the encoder.
+    // Before the first connection a failure is more likely a wrong address
+    // than a lost network, so it is reported as before.
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR &&
+        streamer->config.reconnect.enabled &&
+        streamer->rtmp_connected_once && !streamer->rtmp_reconnect_gave_up) {
+        const gchar *src_name = GST_MESSAGE_SRC_NAME(msg);
+        if (g_str_equal(src_name, "rtmp_sink") ||
+            g_str_equal(src_name, "flvmux") ||
+            g_str_equal(src_name, "rtmp_queue")) {
+            streamer->rtmp_reconnecting = true;
+            streamer->rtmp_connection_failed = true;
+            streamer->monitor_cv.notify_all();
+            return GST_BUS_DROP;
+        }
+    }
+
+    // ENTER is posted from the new streaming thread itself, so the priority
+    // applies to it and to the encoder threads it starts later
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_STREAM_STATUS) {
+        GstStreamStatusType type;
+        GstElement *owner;
+        gst_message_parse_stream_status(msg, &type, &owner);
+        gchar *owner_name = gst_element_get_name(owner);
+        if (type == GST_STREAM_STATUS_TYPE_ENTER &&
+            g_str_equal(owner_name, "archive_queue")) {
+            setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid),
+                        streamer->archive_niceness);
+        }
+        g_free(owner_name);
+    }
+
+    return GST_BUS_PASS;
+}
+
+GstFlowReturn RtmpStreamer::cb_new_encoded_sample(GstAppSink *sink,
+                                                  gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (!sample) {
+        return GST_FLOW_EOS;
+    }
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstMapInfo map;
+    if (buffer && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        EncodedPacket packet = {
+            buffer,
+            map.data,
+            map.size,
+            GST_BUFFER_PTS(buffer),
+            GST_BUFFER_DTS(buffer),
+            !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT),
+        };
+
+        {
+            std::lock_guard<std::mutex> guard(streamer->encoded_packet_mutex);
+            if (streamer->encoded_packet_callback) {
+                streamer->encoded_packet_callback(packet);
+            }
+        }
+        gst_buffer_unmap(buffer, &map);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+GstFlowReturn RtmpStreamer::cb_new_analytics_sample(GstAppSink *sink,
+                                                    gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (!sample) {
+        return GST_FLOW_EOS;
+    }
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstVideoInfo info;
+    GstVideoFrame video_frame;
+    if (buffer && gst_video_info_from_caps(&info, gst_sample_get_caps(sample)) &&
+        gst_video_frame_map(&video_frame, &info, buffer, GST_MAP_READ)) {
+        // Wrap the mapped plane without copying it
+        const cv::Mat frame(GST_VIDEO_INFO_HEIGHT(&info),
+                            GST_VIDEO_INFO_WIDTH(&info), CV_8UC3,
+                            GST_VIDEO_FRAME_PLANE_DATA(&video_frame, 0),
+                            GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame, 0));
+
+        {
+            std::lock_guard<std::mutex> guard(streamer->analytics_mutex);
+            if (streamer->analytics_callback) {
+                streamer->analytics_callback(frame, GST_BUFFER_PTS(buffer));
+            }
+        }
+        gst_video_frame_unmap(&video_frame);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_count_encoded_bytes(GstPad *pad,
+                                                       GstPadProbeInfo *info,
+                                                       gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    gsize size = gst_buffer_get_size(buffer);
+    streamer->encoded_bytes_total += size;
+
+    // The window follows stream time, so it measures what the link has to
+    // carry rather than when the encoder happened to deliver it
+    GstClockTime time = GST_BUFFER_DTS_OR_PTS(buffer);
+    if (!GST_CLOCK_TIME_IS_VALID(time)) {
+        return GST_PAD_PROBE_OK;
+    }
+    auto &window = streamer->bitrate_window;
+    window.emplace_back(time, size);
+    streamer->bitrate_window_bytes += size;
+    while (window.front().first + GST_SECOND <= time) {
+        streamer->bitrate_window_bytes -= window.front().second;
+        window.pop_front();
+    }
+
+    guint64 peak = streamer->peak_window_bytes.load();
+    while (streamer->bitrate_window_bytes > peak &&
+           !streamer->peak_window_bytes.compare_exchange_weak(
+               peak, streamer->bitrate_window_bytes)) {
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_align_keyframe(GstPad *pad,
+                                                  GstPadProbeInfo *info,
+                                                  gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+    uint interval_ms = streamer->gop_align_interval_ms;
+    if (interval_ms == 0) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    gint64 boundary = g_get_real_time() / 1000 / interval_ms;
+    if (boundary == streamer->last_gop_boundary) {
+        return GST_PAD_PROBE_OK;
+    }
+    bool first_frame = streamer->last_gop_boundary < 0;
+    streamer->last_gop_boundary = boundary;
+
+    // The event is serialized, so it applies to the frame held by the probe
+    if (!first_frame) {
+        gst_pad_send_event(pad, gst_video_event_new_downstream_force_key_unit(
+                                    GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE,
+                                    GST_CLOCK_TIME_NONE, TRUE, 0));
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_encoder_input(GstPad *pad,
+                                                 GstPadProbeInfo *info,
+                                                 gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+    uint divisor = streamer->frame_divisor;
+    if (streamer->encoder_input_frames++ % divisor != 0) {
+        streamer->frames_skipped++;
+        return GST_PAD_PROBE_DROP;
+    }
+
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+    std::lock_guard<std::mutex> guard(streamer->encode_time_mutex);
+    auto &frames = streamer->frames_in_encoder;
+    // Frames the encoder drops never leave it
+    if (frames.size() >= MAX_FRAMES_IN_ENCODER) {
+        frames.erase(frames.begin());
+    }
+    frames[pts] = std::chrono::steady_clock::now();
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_encoder_output(GstPad *pad,
+                                                  GstPadProbeInfo *info,
+                                                  gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> guard(streamer->encode_time_mutex);
+    auto &frames = streamer->frames_in_encoder;
+    auto it = frames.find(pts);
+    if (it != frames.end()) {
+        streamer->encode_time_total +=
+            std::chrono::duration<double>(now - it->second).count();
+        streamer->encoded_frames++;
+        frames.erase(it);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_embed_timestamps(GstPad *pad,
+                                                    GstPadProbeInfo *info,
+                                                    gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstReferenceTimestampMeta *meta = gst_buffer_get_reference_timestamp_meta(
+        buffer, streamer->ingest_meta_caps);
+    if (!meta) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    FrameTimestamps timestamps;
+    timestamps.ingest_us = (int64_t)(meta->timestamp / GST_USECOND);
+    gst_structure_get_uint64(gst_caps_get_structure(meta->reference, 0),
+                             "frame-id", &timestamps.frame_id);
+    timestamps.encoder_output_us = wall_clock_us();
+    timestamps.encoder_input_us = timestamps.encoder_output_us;
+    {
+        // The encoder input probe timed the frame on the monotonic clock
+        std::lock_guard<std::mutex> guard(streamer->encode_time_mutex);
+        auto &frames = streamer->frames_in_encoder;
+        auto it = frames.find(GST_BUFFER_PTS(buffer));
+        if (it != frames.end()) {
+            timestamps.encoder_input_us -=
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - it->second)
+                    .count();
+        }
+    }
+
+    // FLV carries length prefixed NAL units, the size of the prefix is in
+    // the codec data
+    size_t nal_length_size = 0;
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (caps) {
+        GstStructure *structure = gst_caps_get_structure(caps, 0);
+        const gchar *stream_format =
+            gst_structure_get_string(structure, "stream-format");
+        if (g_strcmp0(stream_format, "avc") == 0 ||
+            g_strcmp0(stream_format, "avc3") == 0) {
+            nal_length_size = 4;
+            const GValue *codec_data =
+                gst_structure_get_value(structure, "codec_data");
+            GstMapInfo codec_map;
+            if (codec_data &&
+                gst_buffer_map(gst_value_get_buffer(codec_data), &codec_map,
+                               GST_MAP_READ)) {
+                if (codec_map.size > 4) {
+                    nal_length_size = (codec_map.data[4] & 0x03) + 1;
+                }
+                gst_buffer_unmap(gst_value_get_buffer(codec_data), &codec_map);
+            }
+        }
+        gst_caps_unref(caps);
+    }
+
+    // An access unit delimiter has to stay the first NAL unit
+    gsize offset = 0;
+    GstMapInfo map;
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        gsize nal_begin = nal_length_size;
+        gsize nal_size = 0;
+        if (nal_length_size > 0 && map.size > nal_length_size) {
+            for (size_t i = 0; i < nal_length_size; i++) {
+                nal_size = nal_size << 8 | map.data[i];
+            }
+        } else if (map.size > 4 && map.data[0] == 0 && map.data[1] == 0) {
+            nal_begin = map.data[2] == 1 ? 3 : 4;
+            nal_size = 2;
+        }
+        if (nal_size > 0 && nal_begin < map.size &&
+            (map.data[nal_begin] & 0x1f) == 9) {
+            offset = std::min(nal_begin + nal_size, map.size);
+        }
+        gst_buffer_unmap(buffer, &map);
+    }
+
+    std::vector<uint8_t> sei = build_timestamp_sei(timestamps);
+    gsize prefix_size = nal_length_size ? nal_length_size : 4;
+    gsize sei_size = prefix_size + sei.size();
+    guint8 *sei_data = (guint8 *)g_malloc(sei_size);
+    for (gsize i = 0; i < prefix_size; i++) {
+        // A length prefix, or the start code 00 00 00 01
+        sei_data[i] = nal_length_size
+                          ? (guint8)(sei.size() >> (8 * (prefix_size - 1 - i)))
+                          : (i == prefix_size - 1);
+    }
+    memcpy(sei_data + prefix_size, sei.data(), sei.size());
+
+    GstBuffer *out = gst_buffer_new();
+    gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_METADATA, 0, -1);
+    if (offset > 0) {
+        gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_MEMORY, 0, offset);
+    }
+    gst_buffer_append_memory(
+        out, gst_memory_new_wrapped((GstMemoryFlags)0, sei_data, sei_size, 0,
+                                    sei_size, sei_data, g_free));
+    gst_buffer_copy_into(out, buffer, GST_BUFFER_COPY_MEMORY, offset, -1);
+
+    gst_buffer_unref(buffer);
+    GST_PAD_PROBE_INFO_DATA(info) = out;
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_archive_eos(GstPad *pad,
+                                               GstPadProbeInfo *info,
+                                               gpointer user_data) {
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_EOS) {
+        RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+        {
+            std::lock_guard<std::mutex> guard(streamer->archive_mutex);
+            streamer->archive_eos = true;
+        }
+        streamer->archive_cv.notify_all();
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_rtmp_output(GstPad *pad,
+                                               GstPadProbeInfo *info,
+                                               gpointer user_data) {
+    RtmpStreamer *streamer = (RtmpStreamer *)user_data;
+    if (streamer->replaying) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    bool keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    streamer->store_replay_packet(buffer);
+    if (streamer->rtmp_reconnecting) {
+        return GST_PAD_PROBE_DROP;
+    }
+
+    if (streamer->rtmp_restarted.exchange(false)) {
+        // Everything buffered before this frame, which is the last entry
+        std::vector<GstBuffer *> packets;
+        {
+            std::lock_guard<std::mutex> guard(streamer->replay_mutex);
+            if (!streamer->replay_packets.empty()) {
+                for (auto it = streamer->replay_packets.begin();
+                     it + 1 != streamer->replay_packets.end(); ++it) {
+                    packets.push_back(gst_buffer_ref(*it));
+                }
+            }
+        }
+
+        // The old timestamps are late for the new muxer, so the backlog is
+        // sent as fast as the connection takes it and the stream catches up
+        streamer->replaying = true;
+        size_t pushed = 0;
+        GstFlowReturn ret = GST_FLOW_OK;
+        for (GstBuffer *packet : packets) {
+            if (ret == GST_FLOW_OK) {
+                ret = gst_pad_push(pad, packet);
+                pushed++;
+            } else {
+                gst_buffer_unref(packet);
+            }
+        }
+        streamer->replaying = false;
+        streamer->rtmp_wait_keyframe = pushed == 0;
+
+        std::lock_guard<std::mutex> guard(streamer->metrics_mutex);
+        streamer->metrics.rtmp_replayed_frames += pushed;
+    }
+
+    if (streamer->rtmp_wait_keyframe) {
+        if (!keyframe) {
+            return GST_PAD_PROBE_DROP;
+        }
+        streamer->rtmp_wait_keyframe = false;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn RtmpStreamer::cb_drop_until_keyframe(GstPad *pad,
+                                                       GstPadProbeInfo *info,
+                                                       gpointer user_data) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_REMOVE;
+}
+
 bool RtmpStreamer::connect_appsrc_signal_handler() {
     if (!appsrc) {
         return false;